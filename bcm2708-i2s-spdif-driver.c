@@ -46,6 +46,19 @@
 #include <linux/clk.h>
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
+#include <linux/gfp.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <uapi/linux/sched/types.h>
 
 #include <sound/core.h>
 #include <sound/pcm.h>
@@ -160,6 +173,17 @@ static const unsigned int bcm2708_clk_freq[BCM2708_CLK_SRC_HDMI+1] = {
 #define BCM2708_I2S_TX(v)		((v) << 8)
 #define BCM2708_I2S_RX(v)		(v)
 
+/*
+ * The TX FIFO holds 64 words and the DMA refills it below the TX DREQ
+ * level. An encoded frame is 4 words, so about BCM2708_I2S_FIFO_FRAMES
+ * frames that the DMA has read are not sent yet, give or take
+ * BCM2708_I2S_FIFO_SLACK.
+ */
+#define BCM2708_I2S_FIFO_WORDS		64
+#define BCM2708_I2S_TX_DREQ		0x30
+#define BCM2708_I2S_FIFO_FRAMES		(BCM2708_I2S_TX_DREQ / 4)
+#define BCM2708_I2S_FIFO_SLACK		((BCM2708_I2S_FIFO_WORDS - BCM2708_I2S_TX_DREQ) / 4)
+
 #define BCM2708_I2S_INT_RXERR		BIT(3)
 #define BCM2708_I2S_INT_TXERR		BIT(2)
 #define BCM2708_I2S_INT_RXR		BIT(1)
@@ -180,16 +204,127 @@ static unsigned int debug = 0;
 module_param(debug, int, 0644);
 MODULE_PARM_DESC(debug, "debug mask (0: no debug messages)");
 
+static char *encoder;
+module_param(encoder, charp, 0444);
+MODULE_PARM_DESC(encoder, "SPDIF encoder: frame, block, wide, bitpar or simd "
+		 "(default: fastest on this CPU)");
+
+static unsigned int encode_cpus;
+module_param(encode_cpus, uint, 0644);
+MODULE_PARM_DESC(encode_cpus, "CPUs used to encode large regions ahead of time "
+		 "(0: all online CPUs, 1: no parallel encoding)");
+
+static unsigned int ring_ms = 8;
+module_param(ring_ms, uint, 0644);
+MODULE_PARM_DESC(ring_ms, "encoded ring size in ms, used from the next prepare "
+		 "(default: 8)");
+
+static unsigned int ring_segments = 2;
+module_param(ring_segments, uint, 0644);
+MODULE_PARM_DESC(ring_segments, "DMA segments (interrupts) per encoded ring, "
+		 "used from the next prepare (default: 2)");
+
+static unsigned int encode_thread_prio;
+module_param(encode_thread_prio, uint, 0444);
+MODULE_PARM_DESC(encode_thread_prio, "encode in a SCHED_FIFO kernel thread of "
+		 "this priority, 1..99, instead of the DMA callback (0: off)");
+
+static int encode_thread_cpu = -1;
+module_param(encode_thread_cpu, int, 0444);
+MODULE_PARM_DESC(encode_thread_cpu, "CPU the encoder thread is bound to "
+		 "(-1: any)");
+
+static bool encode_on_write;
+module_param(encode_on_write, bool, 0444);
+MODULE_PARM_DESC(encode_on_write, "encode in the writer's context when frames "
+		 "are written or committed (default: off)");
+
+static unsigned int pcm_buffer_kb = 128;
+module_param(pcm_buffer_kb, uint, 0444);
+MODULE_PARM_DESC(pcm_buffer_kb, "preallocated PCM buffer in KB, the largest "
+		 "buffer an application can use (default: 128)");
+
+static char *ring_memory;
+module_param(ring_memory, charp, 0444);
+MODULE_PARM_DESC(ring_memory, "memory of the encoded ring: coherent, wc or "
+		 "cached (default: fastest on this board)");
+
+static bool idle_loop = true;
+module_param(idle_loop, bool, 0444);
+MODULE_PARM_DESC(idle_loop, "after a stream stops, loop one block of silence "
+		 "without DMA interrupts instead of stopping the output "
+		 "(default: on)");
+
 /* General device struct */
 
-#define SPDIF_BUFSIZE_FRAMES	(2 * SPDIF_BLOCKSIZE)	/* buffer size in SPDIF frames */
-#define SPDIF_BUFSIZE			(SPDIF_BUFSIZE_FRAMES * SPDIF_FRAMESIZE)
-#define PCM_PERIODES			8
-/* PCM period size must be divisible by 192*4 (S16_LE), 192*6 (S24_3LE) and 192*8 (S24_LE) */
-#define PCM_PERIOD_SIZE			(SPDIF_BLOCKSIZE * 24)
-#define PCM_BUFSIZE				(PCM_PERIODES * PCM_PERIOD_SIZE)	/* PCM buffer size */
+/*
+ * The encoded ring holds ring_ms of audio at the stream rate and is split
+ * into ring_segments DMA periods, so the interrupt rate does not depend on
+ * the sample rate.
+ */
+#define SPDIF_RING_MAX_MS		1000
+#define SPDIF_RING_MIN_SEGMENTS		2
+#define SPDIF_RING_MAX_SEGMENTS		64
+#define SPDIF_SEGMENT_MIN_FRAMES	32
+#define SPDIF_RING_MIN_FRAMES		(2 * SPDIF_BLOCKSIZE)	/* smallest allocation */
+/*
+ * Segments kept filled when encoding at write time: the one being sent
+ * and two more, so that one missed DMA callback does not underrun.
+ */
+#define SPDIF_RING_AHEAD_SEGMENTS	3
+
+/*
+ * Silence looped by the DMA while there is no stream: one block, taken
+ * from two encoded ones so that the loop can start at any frame of the
+ * block. The switch to the ring encodes SPDIF_IDLE_SWITCH_FRAMES once the
+ * frame the loop is at is known, with interrupts off until the ring runs.
+ */
+#define SPDIF_IDLE_BYTES		(SPDIF_BLOCKSIZE * SPDIF_FRAMESIZE)
+#define SPDIF_IDLE_ALLOC_BYTES		(2 * SPDIF_IDLE_BYTES)
+#define SPDIF_IDLE_SWITCH_FRAMES	SPDIF_SEGMENT_MIN_FRAMES
 
-typedef void (*spdif_encode_func)(struct spdif_encoder *, void *, const void *);
+/*
+ * Memory of the encoded ring. Coherent memory is uncached on most Pis, so
+ * every store of the encoder goes to the bus on its own. A write-combining
+ * mapping merges the stores of a frame; cached memory, from
+ * dma_alloc_noncoherent(), is written back with a DMA sync after each
+ * write.
+ */
+enum bcm2708_i2s_ring_mem {
+	RING_MEM_COHERENT,
+	RING_MEM_WC,
+	RING_MEM_CACHED,
+	RING_MEM_COUNT,
+};
+
+static const char *const bcm2708_i2s_ring_mem_names[RING_MEM_COUNT] = {
+	[RING_MEM_COHERENT] = "coherent",
+	[RING_MEM_WC] = "wc",
+	[RING_MEM_CACHED] = "cached",
+};
+
+/*
+ * The PCM buffer is preallocated with pcm_buffer_kb KB of vmalloc memory:
+ * only the encoder reads it, and large buffers are not limited by the
+ * largest contiguous allocation. Periods can be
+ * as short as a segment; the encoder wraps at the end of the buffer, so
+ * neither has to be a multiple of the SPDIF block.
+ */
+#define PCM_BUFFER_KB_MAX		(32 * 1024)
+#define PCM_PERIOD_MIN_FRAMES		SPDIF_SEGMENT_MIN_FRAMES
+#define PCM_PERIODS_MAX			1024
+
+/* part of a region encoded on another CPU */
+struct bcm2708_i2s_encode_work {
+	struct work_struct work;
+	struct spdif_encoder spdif;	/* copy positioned at the first frame */
+	void *dst;
+	const void *src;
+	unsigned int nframes;
+	enum spdif_format format;
+	atomic_t *pending;
+	struct completion *done;
+};
 
 struct bcm2708_i2s_dev {
 	spinlock_t lock;
@@ -200,33 +335,429 @@ struct bcm2708_i2s_dev {
 
 	struct regmap *i2s_regmap;
 	struct clk *clk;
+	unsigned int bclk_rate; /* set by bcm_2708_i2s_init_clock() */
+	bool clk_enabled;
 
 	struct dma_chan *i2s_dma;
+	struct dma_chan *i2s_dma_spare; /* takes over on a switch, or NULL */
 	dma_cookie_t i2s_dma_cookie;
-
-	uint8_t *spdif_buffer; /* size in bytes: SPDIF_BUFSIZE */
+	bool idle; /* the DMA is looping idle_buffer, not the ring */
+	bool priming; /* the trigger is encoding the start of the ring */
+	uint8_t *idle_buffer; /* encoded silence, two blocks */
+	dma_addr_t idle_handle;
+	unsigned int idle_ctr; /* frame of the block the loop starts at */
+	bool idle_encoded; /* idle_buffer has the current channel status */
+
+	uint8_t *spdif_buffer; /* encoded ring */
 	dma_addr_t spdif_buffer_handle; /* bus address of spdif_buffer */
+	unsigned int ring_alloc_frames; /* size of spdif_buffer in SPDIF frames */
+	enum bcm2708_i2s_ring_mem ring_mem; /* memory of spdif_buffer */
+	unsigned int ring_frames; /* segments * segment_frames */
+	unsigned int segment_frames; /* SPDIF frames per DMA period */
+	unsigned int segments;
+	unsigned int ring_write; /* next ring frame to refill */
+	unsigned long late_segments; /* refilled by a later callback */
 
+	/*
+	 * Encoding at write/ack time: the writer encodes into the ring and
+	 * the DMA callback only advances the pointer, adding silence if the
+	 * writer falls behind. The ring state is protected by lock, the
+	 * writer's encoding is serialized by write_mutex.
+	 */
+	bool encode_on_write; /* latched at open */
+	bool ring_on_write; /* the running DMA uses this mode */
+	bool running; /* between TRIGGER_START and TRIGGER_STOP */
+	bool paused; /* between PAUSE_PUSH and PAUSE_RELEASE */
+	snd_pcm_uframes_t encode_appl; /* appl_ptr up to which PCM is encoded */
+	struct mutex write_mutex;
+	bool write_blocked; /* the writer found the ring full */
+	struct work_struct write_work; /* encodes the rest as the ring drains */
+	unsigned int ring_read; /* start of the segment being sent */
+	unsigned int ring_queued; /* frames from ring_read to ring_write */
+	unsigned int ring_ctr; /* SPDIF frame counter at ring_write */
+	unsigned int *segment_pcm; /* PCM frames in each segment */
+	unsigned int *segment_pcm_end; /* where they end in the segment */
+	struct spdif_encoder spdif_idle; /* silence written by the callback */
+
+	/* encoder thread, NULL if the DMA callback encodes */
+	struct task_struct *encode_task;
+	atomic_t refill_pending;
+	struct mutex refill_mutex; /* held by the thread while refilling */
+
+	size_t pcm_buffer_bytes; /* preallocated PCM buffer */
 	snd_pcm_uframes_t pcm_pointer;
+	u64 pcm_frames; /* PCM frames pcm_pointer moved over since the start */
 
 	struct spdif_encoder spdif;
 
 	struct snd_card *card;
 	struct snd_pcm *pcm;
 	struct snd_pcm_substream *ss; /* current substream or NULL */
+	struct work_struct elapsed_work; /* reports elapsed periods */
 
 	int period_frames;
-	spdif_encode_func encode_frame;
+	enum spdif_format format; /* SPDIF_FORMAT_NONE until prepared */
 	atomic_t silence;
+
+	/* parallel encoding, NULL if not available */
+	struct workqueue_struct *encode_wq;
+	struct bcm2708_i2s_encode_work __percpu *encode_work;
 };
 
+/* the clock is enabled once and only reprogrammed when the rate changes */
 static void bcm_2708_i2s_init_clock(struct bcm2708_i2s_dev *dev,
 				    unsigned bclk_rate)
 {
-	if (clk_set_rate(dev->clk, bclk_rate) != 0)
-		dev_err(dev->dev, "cannot set clock rate to %u\n", bclk_rate);
-	if (clk_prepare_enable(dev->clk) != 0)
-		dev_err(dev->dev, "cannot enable clock\n");
+	if (bclk_rate != dev->bclk_rate) {
+		if (clk_set_rate(dev->clk, bclk_rate) != 0)
+			dev_err(dev->dev, "cannot set clock rate to %u\n", bclk_rate);
+		else
+			dev->bclk_rate = bclk_rate;
+	}
+	if (!dev->clk_enabled) {
+		if (clk_prepare_enable(dev->clk) != 0)
+			dev_err(dev->dev, "cannot enable clock\n");
+		else
+			dev->clk_enabled = true;
+	}
+}
+
+/*
+ * Encoded ring
+ */
+
+static void *bcm2708_i2s_ring_mem_alloc(struct bcm2708_i2s_dev *dev,
+					enum bcm2708_i2s_ring_mem mem,
+					size_t size, dma_addr_t *handle)
+{
+	switch (mem) {
+	case RING_MEM_WC:
+		return dma_alloc_wc(dev->dev, size, handle, GFP_KERNEL);
+	case RING_MEM_CACHED:
+		return dma_alloc_noncoherent(dev->dev, size, handle,
+					     DMA_TO_DEVICE, GFP_KERNEL);
+	default:
+		return dma_alloc_coherent(dev->dev, size, handle, GFP_KERNEL);
+	}
+}
+
+static void bcm2708_i2s_ring_mem_free(struct bcm2708_i2s_dev *dev,
+				      enum bcm2708_i2s_ring_mem mem,
+				      size_t size, void *buffer,
+				      dma_addr_t handle)
+{
+	switch (mem) {
+	case RING_MEM_WC:
+		dma_free_wc(dev->dev, size, buffer, handle);
+		break;
+	case RING_MEM_CACHED:
+		dma_free_noncoherent(dev->dev, size, buffer, handle,
+				     DMA_TO_DEVICE);
+		break;
+	default:
+		dma_free_coherent(dev->dev, size, buffer, handle);
+		break;
+	}
+}
+
+/*
+ * Makes frames encoded into the ring from start visible to the DMA,
+ * wrapping at its end. Only cached memory needs it; the CPU never reads
+ * the ring, so there is no sync for the CPU before writing.
+ */
+static void bcm2708_i2s_sync_ring(struct bcm2708_i2s_dev *dev,
+				  unsigned int start, unsigned int frames)
+{
+	unsigned int n;
+
+	if (dev->ring_mem != RING_MEM_CACHED)
+		return;
+	for (; frames; frames -= n) {
+		n = min(frames, dev->ring_frames - start);
+		dma_sync_single_for_device(dev->dev,
+					   dev->spdif_buffer_handle +
+					   start * SPDIF_FRAMESIZE,
+					   n * SPDIF_FRAMESIZE, DMA_TO_DEVICE);
+		start = 0;
+	}
+}
+
+/* grows spdif_buffer to at least frames SPDIF frames, the DMA must be stopped */
+static int bcm2708_i2s_alloc_ring(struct bcm2708_i2s_dev *dev,
+				  unsigned int frames)
+{
+	dma_addr_t handle;
+	uint8_t *buffer;
+
+	frames = max_t(unsigned int, frames, SPDIF_RING_MIN_FRAMES);
+	if (frames <= dev->ring_alloc_frames)
+		return 0;
+	buffer = bcm2708_i2s_ring_mem_alloc(dev, dev->ring_mem,
+					    frames * SPDIF_FRAMESIZE, &handle);
+	if (buffer == NULL)
+		return -ENOMEM;
+	if (dev->spdif_buffer)
+		bcm2708_i2s_ring_mem_free(dev, dev->ring_mem,
+					  dev->ring_alloc_frames * SPDIF_FRAMESIZE,
+					  dev->spdif_buffer, dev->spdif_buffer_handle);
+	dev->spdif_buffer = buffer;
+	dev->spdif_buffer_handle = handle;
+	dev->ring_alloc_frames = frames;
+	return 0;
+}
+
+/* allocates the idle block in the memory chosen for the ring */
+static int bcm2708_i2s_alloc_idle(struct bcm2708_i2s_dev *dev)
+{
+	dev->idle_buffer = bcm2708_i2s_ring_mem_alloc(dev, dev->ring_mem,
+						      SPDIF_IDLE_ALLOC_BYTES,
+						      &dev->idle_handle);
+	return dev->idle_buffer ? 0 : -ENOMEM;
+}
+
+static void bcm2708_i2s_free_ring(struct bcm2708_i2s_dev *dev)
+{
+	kfree(dev->segment_pcm);
+	dev->segment_pcm = NULL;
+	if (dev->idle_buffer) {
+		bcm2708_i2s_ring_mem_free(dev, dev->ring_mem,
+					  SPDIF_IDLE_ALLOC_BYTES,
+					  dev->idle_buffer, dev->idle_handle);
+		dev->idle_buffer = NULL;
+	}
+	if (dev->spdif_buffer == NULL)
+		return;
+	bcm2708_i2s_ring_mem_free(dev, dev->ring_mem,
+				  dev->ring_alloc_frames * SPDIF_FRAMESIZE,
+				  dev->spdif_buffer, dev->spdif_buffer_handle);
+	dev->spdif_buffer = NULL;
+	dev->ring_alloc_frames = 0;
+}
+
+static void bcm2708_i2s_sync_dma(struct bcm2708_i2s_dev *dev);
+static void bcm2708_i2s_stop_ring(struct bcm2708_i2s_dev *dev);
+
+/*
+ * Sets up the ring for a stream from the ring_ms and ring_segments
+ * parameters. A segment is never more than half of the PCM buffer, which
+ * the DMA callback reads one segment at a time, nor more than a period,
+ * which then gets more segments so that every period is reported when it
+ * has been sent. When encoding at write
+ * time the ring also has room for the PCM buffer and the silence ahead of
+ * it, up to SPDIF_RING_MAX_SEGMENTS; frames that do not fit are encoded
+ * as the DMA makes room. First waits for the callbacks of the last
+ * stream's ring, which the switch to the idle loop leaves running. Stops
+ * the DMA on the ring if the geometry or the mode changes; it is
+ * restarted by bcm2708_i2s_dmaengine_prepare_and_submit(). The idle loop
+ * does not use the ring and keeps running.
+ */
+static int bcm2708_i2s_set_ring(struct bcm2708_i2s_dev *dev, unsigned int rate,
+				snd_pcm_uframes_t buffer_size,
+				snd_pcm_uframes_t period_size)
+{
+	unsigned int ms, segments, segment_frames, ring;
+	unsigned int *segment_pcm;
+	int ret;
+
+	bcm2708_i2s_sync_dma(dev);
+	ms = clamp_t(unsigned int, READ_ONCE(ring_ms), 1, SPDIF_RING_MAX_MS);
+	segments = clamp_t(unsigned int, READ_ONCE(ring_segments),
+			   SPDIF_RING_MIN_SEGMENTS, SPDIF_RING_MAX_SEGMENTS);
+	ring = DIV_ROUND_UP(rate * ms, 1000);
+	segment_frames = DIV_ROUND_UP(ring, segments);
+	if (segment_frames > period_size) {
+		segment_frames = period_size;
+		segments = clamp_t(unsigned int, DIV_ROUND_UP(ring, segment_frames),
+				   SPDIF_RING_MIN_SEGMENTS, SPDIF_RING_MAX_SEGMENTS);
+	}
+	segment_frames = max_t(unsigned int, segment_frames,
+			       SPDIF_SEGMENT_MIN_FRAMES);
+	segment_frames = min_t(unsigned int, segment_frames, buffer_size / 2);
+	if (dev->encode_on_write)
+		segments = clamp_t(unsigned int,
+				   DIV_ROUND_UP(buffer_size, segment_frames) +
+				   SPDIF_RING_AHEAD_SEGMENTS + 1,
+				   segments, SPDIF_RING_MAX_SEGMENTS);
+
+	if (segment_frames == dev->segment_frames && segments == dev->segments &&
+	    dev->encode_on_write == dev->ring_on_write)
+		return 0;
+	if (dev->i2s_dma_cookie > 0 && !dev->idle)
+		bcm2708_i2s_stop_ring(dev);
+	segment_pcm = kcalloc(2 * segments, sizeof(*segment_pcm), GFP_KERNEL);
+	if (segment_pcm == NULL)
+		return -ENOMEM;
+	/* callbacks of the old ring have finished or see idle and return */
+	ret = bcm2708_i2s_alloc_ring(dev, segments * segment_frames);
+	if (ret) {
+		kfree(segment_pcm);
+		dev->segment_frames = 0;
+	} else {
+		kfree(dev->segment_pcm);
+		dev->segment_pcm = segment_pcm;
+		dev->segment_pcm_end = segment_pcm + segments;
+		dev->ring_on_write = dev->encode_on_write;
+		dev->segment_frames = segment_frames;
+		dev->segments = segments;
+		dev->ring_frames = segments * segment_frames;
+		dprintk(DBG_ALSA, "ring: %u segments of %u frames\n", segments,
+			segment_frames);
+	}
+	return ret;
+}
+
+/*
+ * Splits the PCM frames in the ring, found from the DMA residue, into
+ * the frames sent since the last callback and the frames encoded but not
+ * sent yet. The PCM frames of the segment being sent are taken to be
+ * contiguous, which is exact unless the writer fell behind and caught up
+ * again within the segment. Called with lock held.
+ */
+static void bcm2708_i2s_ring_pcm(struct bcm2708_i2s_dev *dev,
+				 unsigned int *sent, unsigned int *unsent)
+{
+	struct dma_tx_state state;
+	unsigned int pos, base, segment, s, end, i, n, p;
+
+	*sent = 0;
+	*unsent = 0;
+	if (dev->i2s_dma_cookie <= 0 || dev->idle || dev->segment_pcm == NULL)
+		return;
+	dmaengine_tx_status(dev->i2s_dma, dev->i2s_dma_cookie, &state);
+	pos = (dev->ring_frames * SPDIF_FRAMESIZE - state.residue) /
+	      SPDIF_FRAMESIZE % dev->ring_frames;
+
+	/* segments from the one the last callback saw being sent */
+	base = (dev->ring_on_write ? dev->ring_read : dev->ring_write) /
+	       dev->segment_frames;
+	segment = (pos / dev->segment_frames + dev->segments - base) % dev->segments;
+	for (i = 0; i < dev->segments; i++) {
+		s = (base + i) % dev->segments;
+		p = dev->segment_pcm[s];
+		if (i < segment) {
+			n = 0;
+		} else if (i == segment) {
+			end = dev->segment_pcm_end[s];
+			n = min(p, end - min(end, pos % dev->segment_frames));
+		} else
+			n = p;
+		*sent += p - n;
+		*unsent += n;
+	}
+}
+
+/*
+ * Parallel encoding
+ */
+
+/* smallest part of a region worth encoding on another CPU */
+#define ENCODE_PART_MIN_FRAMES	(2 * SPDIF_BLOCKSIZE)
+
+static void bcm2708_i2s_encode_work_fn(struct work_struct *work)
+{
+	struct bcm2708_i2s_encode_work *w =
+		container_of(work, struct bcm2708_i2s_encode_work, work);
+
+	spdif_encode_block(&w->spdif, w->dst, w->src, w->nframes, w->format);
+	if (atomic_dec_and_test(w->pending))
+		complete(w->done);
+}
+
+/*
+ * Encodes nframes frames ahead of time, from process context. Every
+ * subframe ends at the level it starts with and the channel status
+ * position follows from the frame index, so a large region is split into
+ * parts of whole blocks that are encoded at the same time on the per-CPU
+ * workqueue, each by a copy of the encoder positioned at its first frame.
+ * The calling CPU encodes the first part, which the DMA may already be
+ * about to send. src is NULL for silence.
+ */
+static void bcm2708_i2s_encode_ahead(struct bcm2708_i2s_dev *dev, void *dst,
+				     const void *src, unsigned int nframes,
+				     enum spdif_format format)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bcm2708_i2s_encode_work *w;
+	unsigned int cpus, parts, part_frames, offset, start, n;
+	size_t frame_size = spdif_pcm_frame_size(format);
+	atomic_t pending;
+	int cpu, this_cpu;
+
+	cpus = num_online_cpus();
+	if (encode_cpus && encode_cpus < cpus)
+		cpus = encode_cpus;
+	parts = min(cpus, nframes / ENCODE_PART_MIN_FRAMES);
+	if (parts < 2 || dev->encode_wq == NULL) {
+		spdif_encode_block(&dev->spdif, dst, src, nframes, format);
+		return;
+	}
+	part_frames = roundup(DIV_ROUND_UP(nframes, parts), SPDIF_BLOCKSIZE);
+	start = dev->spdif.frame_ctr;
+	/* one reference held by this CPU until its own part is done */
+	atomic_set(&pending, 1);
+
+	cpus_read_lock();
+	this_cpu = raw_smp_processor_id();
+	offset = part_frames;
+	for_each_online_cpu(cpu) {
+		if (offset >= nframes)
+			break;
+		if (cpu == this_cpu)
+			continue;
+		n = min(part_frames, nframes - offset);
+		w = per_cpu_ptr(dev->encode_work, cpu);
+		w->spdif = dev->spdif;
+		w->spdif.frame_ctr = (start + offset) % SPDIF_BLOCKSIZE;
+		w->dst = (uint8_t *)dst + offset * SPDIF_FRAMESIZE;
+		w->src = src ? (const uint8_t *)src + offset * frame_size : NULL;
+		w->nframes = n;
+		w->format = format;
+		w->pending = &pending;
+		w->done = &done;
+		atomic_inc(&pending);
+		queue_work_on(cpu, dev->encode_wq, &w->work);
+		offset += n;
+	}
+	cpus_read_unlock();
+
+	spdif_encode_block(&dev->spdif, dst, src, part_frames, format);
+	/* the rest, if fewer CPUs are online than counted */
+	if (offset < nframes) {
+		dev->spdif.frame_ctr = (start + offset) % SPDIF_BLOCKSIZE;
+		spdif_encode_block(&dev->spdif,
+				   (uint8_t *)dst + offset * SPDIF_FRAMESIZE,
+				   src ? (const uint8_t *)src + offset * frame_size : NULL,
+				   nframes - offset, format);
+	}
+	dev->spdif.frame_ctr = (start + nframes) % SPDIF_BLOCKSIZE;
+
+	if (!atomic_dec_and_test(&pending))
+		wait_for_completion(&done);
+}
+
+static void bcm2708_i2s_init_encode_work(struct bcm2708_i2s_dev *dev)
+{
+	int cpu;
+
+	dev->encode_work = alloc_percpu(struct bcm2708_i2s_encode_work);
+	if (dev->encode_work == NULL)
+		return;
+	dev->encode_wq = alloc_workqueue("bcm2708-spdif-enc", WQ_HIGHPRI, 0);
+	if (dev->encode_wq == NULL) {
+		free_percpu(dev->encode_work);
+		dev->encode_work = NULL;
+		return;
+	}
+	for_each_possible_cpu(cpu)
+		INIT_WORK(&per_cpu_ptr(dev->encode_work, cpu)->work,
+			  bcm2708_i2s_encode_work_fn);
+}
+
+static void bcm2708_i2s_free_encode_work(struct bcm2708_i2s_dev *dev)
+{
+	if (dev->encode_wq)
+		destroy_workqueue(dev->encode_wq);
+	free_percpu(dev->encode_work);
 }
 
 /*
@@ -237,7 +768,10 @@ static struct snd_device_ops bcm2708_i2s_alsa_device_ops = { NULL };
 static struct snd_pcm_hardware bcm2708_i2s_pcm_hw = {
         .info             = SNDRV_PCM_INFO_MMAP |
                             SNDRV_PCM_INFO_INTERLEAVED |
-                            SNDRV_PCM_INFO_BLOCK_TRANSFER,
+                            SNDRV_PCM_INFO_BLOCK_TRANSFER |
+                            SNDRV_PCM_INFO_PAUSE |
+                            SNDRV_PCM_INFO_HAS_LINK_ATIME |
+                            SNDRV_PCM_INFO_NO_PERIOD_WAKEUP,
         .formats          = SNDRV_PCM_FMTBIT_S16_LE |
                             SNDRV_PCM_FMTBIT_S20_LE | SNDRV_PCM_FMTBIT_S20_3LE |
                             SNDRV_PCM_FMTBIT_S24_LE | SNDRV_PCM_FMTBIT_S24_3LE |
@@ -253,21 +787,56 @@ static struct snd_pcm_hardware bcm2708_i2s_pcm_hw = {
         .rate_max         = 192000,
         .channels_min     = 2,
         .channels_max     = 2,
-        .buffer_bytes_max = PCM_BUFSIZE,
-        .period_bytes_min = PCM_PERIOD_SIZE,
-        .period_bytes_max = PCM_PERIOD_SIZE,
-        .periods_min      = PCM_PERIODES,
-        .periods_max      = PCM_PERIODES,
+        /* buffer_bytes_max and period_bytes_max are set at open */
+        .period_bytes_min = PCM_PERIOD_MIN_FRAMES * 4,	/* S16_LE */
+        .periods_min      = 2,
+        .periods_max      = PCM_PERIODS_MAX,
 };
 
+/*
+ * Frames taken into the ring cannot be taken back. Where ALSA can refuse
+ * rewinds, the pointer follows the DMA in both modes; otherwise it stays
+ * at the frames taken when the DMA callback encodes, so that a rewind
+ * cannot reach them.
+ */
+#ifdef SNDRV_PCM_INFO_NO_REWINDS
+#define BCM2708_I2S_NO_REWINDS		SNDRV_PCM_INFO_NO_REWINDS
+#else
+#define BCM2708_I2S_NO_REWINDS		0
+#endif
+
 static int bcm2708_i2s_dmaengine_prepare_and_submit(struct bcm2708_i2s_dev *dev);
+static int bcm2708_i2s_start_idle(struct bcm2708_i2s_dev *dev, bool prepare);
+static void bcm2708_i2s_write_pcm(struct bcm2708_i2s_dev *dev,
+				  unsigned int frames);
+static void bcm2708_i2s_write_committed(struct bcm2708_i2s_dev *dev);
+static void bcm2708_i2s_drop_ring(struct bcm2708_i2s_dev *dev, bool pause);
+static bool bcm2708_i2s_rewound(struct bcm2708_i2s_dev *dev);
 
 static int bcm2708_pcm_open(struct snd_pcm_substream *ss)
 {
 	struct bcm2708_i2s_dev *dev = ss->pcm->private_data;
+	struct snd_pcm_runtime *runtime = ss->runtime;
+	int ret;
+
 	ss->private_data = dev;
 	dprintk(DBG_ALSA, "dev=%p\n", dev);
-	ss->runtime->hw = bcm2708_i2s_pcm_hw;
+	runtime->hw = bcm2708_i2s_pcm_hw;
+	runtime->hw.buffer_bytes_max = dev->pcm_buffer_bytes;
+	runtime->hw.period_bytes_max = dev->pcm_buffer_bytes / 2;
+	/* whole periods in the buffer, each at least a segment */
+	ret = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+	if (ret < 0)
+		return ret;
+	ret = snd_pcm_hw_constraint_minmax(runtime, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+					   PCM_PERIOD_MIN_FRAMES, UINT_MAX);
+	if (ret < 0)
+		return ret;
+	/* appl_ptr updates must reach .ack, so no mmap of the control page */
+	dev->encode_on_write = READ_ONCE(encode_on_write);
+	if (dev->encode_on_write)
+		runtime->hw.info |= SNDRV_PCM_INFO_SYNC_APPLPTR;
+	runtime->hw.info |= BCM2708_I2S_NO_REWINDS;
 	dprintk(DBG_ALSA, "pcm_open\n");
 	dev->ss = ss;
 	return 0;
@@ -278,6 +847,8 @@ static int bcm2708_pcm_close(struct snd_pcm_substream *ss)
 	struct bcm2708_i2s_dev *dev = ss->pcm->private_data;
 	ss->private_data = NULL;
 	dev->ss = NULL;
+	cancel_work_sync(&dev->elapsed_work);
+	cancel_work_sync(&dev->write_work);
 	return 0;
 }
 
@@ -308,6 +879,15 @@ static int bcm2708_hw_params(struct snd_pcm_substream *ss,
 	return res;
 }
 
+/* a refill of the last stream's ring may still be reading the buffer */
+static int bcm2708_hw_free(struct snd_pcm_substream *ss)
+{
+	struct bcm2708_i2s_dev *dev = ss->pcm->private_data;
+
+	bcm2708_i2s_sync_dma(dev);
+	return snd_pcm_lib_free_pages(ss);
+}
+
 #define CASE_RATE(n) \
 	case n: \
 		ch_stat[3] = SPDIF_CS3_##n; \
@@ -315,7 +895,7 @@ static int bcm2708_hw_params(struct snd_pcm_substream *ss,
 
 static int bcm2708_pcm_prepare(struct snd_pcm_substream *ss)
 {
-	int silence;
+	int silence, ret;
 	uint8_t ch_stat[] = { SPDIF_CS0_NOT_COPYRIGHT,
 			      SPDIF_CS1_DDCONV | SPDIF_CS1_ORIGINAL,
 			      0,
@@ -343,18 +923,18 @@ static int bcm2708_pcm_prepare(struct snd_pcm_substream *ss)
 	}
 	switch (ss->runtime->format) {
 		case SNDRV_PCM_FORMAT_S16_LE:
-			dev->encode_frame = spdif_encode_frame_s16le;
+			dev->format = SPDIF_FORMAT_S16_LE;
 			break;
 		case SNDRV_PCM_FORMAT_S20_LE:
 		case SNDRV_PCM_FORMAT_S24_LE:
-			dev->encode_frame = spdif_encode_frame_s24le;
+			dev->format = SPDIF_FORMAT_S24_LE;
 			break;
 		case SNDRV_PCM_FORMAT_S20_3LE:
 		case SNDRV_PCM_FORMAT_S24_3LE:
-			dev->encode_frame = spdif_encode_frame_s24le_packed;
+			dev->format = SPDIF_FORMAT_S24_3LE;
 			break;
 		case SNDRV_PCM_FORMAT_S32_LE:
-			dev->encode_frame = spdif_encode_frame_s32le;
+			dev->format = SPDIF_FORMAT_S32_LE;
 			break;
 		default:
 			dev_err(dev->dev, "%s: invalid format: %u\n", __func__, ss->runtime->format);
@@ -372,7 +952,24 @@ static int bcm2708_pcm_prepare(struct snd_pcm_substream *ss)
 			ch_stat[4] = SPDIF_CS4_MAX_WORDLEN_24 | SPDIF_CS4_WORDLEN_24_20;
 			break;
 	}
-	spdif_encoder_set_channel_status(&dev->spdif, ch_stat, sizeof(ch_stat));
+	/* without period wakeups the period does not limit the segments */
+	ret = bcm2708_i2s_set_ring(dev, ss->runtime->rate, ss->runtime->buffer_size,
+				   ss->runtime->no_period_wakeup ?
+				   ss->runtime->buffer_size : ss->runtime->period_size);
+	if (ret) {
+		dev_err(dev->dev, "cannot allocate the encoded ring\n");
+		return ret;
+	}
+	/* the rest of the channel status is always zero */
+	if (memcmp(dev->spdif.channel_status, ch_stat, sizeof(ch_stat)) != 0) {
+		spdif_encoder_set_channel_status(&dev->spdif, ch_stat, sizeof(ch_stat));
+		dev->idle_encoded = false;
+	}
+	dev->paused = false;
+	if (dev->ring_on_write) {
+		dev->spdif_idle = dev->spdif;
+		dev->encode_appl = 0;
+	}
 	bcm_2708_i2s_init_clock(dev, 128 * ss->runtime->rate);
 	silence = atomic_cmpxchg(&dev->silence, 0, 1);
 	if (silence != 0) {
@@ -380,7 +977,7 @@ static int bcm2708_pcm_prepare(struct snd_pcm_substream *ss)
 	} else {
 		dev_info(dev->dev, "Prepare %u-bit %u Hz\n", ss->runtime->sample_bits, ss->runtime->rate);
 	}
-	bcm2708_i2s_dmaengine_prepare_and_submit(dev);
+	bcm2708_i2s_start_idle(dev, true);
 	return 0;
 }
 
@@ -390,132 +987,1073 @@ static int bcm2708_pcm_trigger(struct snd_pcm_substream *ss, int cmd)
 	int ret = 0;
 	int silence;
 
+	/* .copy and write_work do not run under the stream lock */
+	if (dev->pcm->nonatomic)
+		mutex_lock(&dev->write_mutex);
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
 		dprintk(DBG_ALSA, "SNDRV_PCM_TRIGGER_START\n");
 		dev->pcm_pointer = 0;
+		dev->pcm_frames = 0;
 		dev->period_frames = 0;
 		silence = atomic_xchg(&dev->silence, 0);
 		if (silence > 1) {
-			dev_info(dev->dev, "Start: %d frames silenced\n", (silence + 1) * SPDIF_BUFSIZE_FRAMES / 2);
+			dev_info(dev->dev, "Start: %d frames silenced\n", (silence + 1) * dev->segment_frames);
 		} else {
 			dev_info(dev->dev, "Start\n");
 		}
 		bcm2708_i2s_dmaengine_prepare_and_submit(dev);
+		if (dev->ring_on_write) {
+			/* frames written before the start */
+			dev->running = true;
+			bcm2708_i2s_write_committed(dev);
+		}
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 		dprintk(DBG_ALSA, "SNDRV_PCM_TRIGGER_STOP\n");
-		dev_info(dev->dev, "Stop\n");
-		dmaengine_terminate_all(dev->i2s_dma);
+		dev->running = false;
+		dev->paused = false;
+		if (dev->late_segments)
+			dev_info(dev->dev, "Stop: %lu segments refilled late\n",
+				 dev->late_segments);
+		else
+			dev_info(dev->dev, "Stop\n");
+		dev->late_segments = 0;
+		if (idle_loop) {
+			bcm2708_i2s_start_idle(dev, false);
+			break;
+		}
+		/* an atomic trigger cannot wait, prepare and hw_free do */
+		dmaengine_terminate_async(dev->i2s_dma);
 		dev->i2s_dma_cookie = 0;
 		break;
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		dprintk(DBG_ALSA, "SNDRV_PCM_TRIGGER_PAUSE_PUSH\n");
+		dev->paused = true;
+		if (dev->ring_on_write) {
+			dev->running = false;
+			bcm2708_i2s_drop_ring(dev, true);
+		}
+		break;
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		dprintk(DBG_ALSA, "SNDRV_PCM_TRIGGER_PAUSE_RELEASE\n");
+		dev->paused = false;
+		if (dev->ring_on_write) {
+			/* frames written while paused and the ones dropped */
+			dev->running = true;
+			bcm2708_i2s_write_committed(dev);
+		}
+		break;
 	default:
 		ret = -EINVAL;
 	}
+	if (dev->pcm->nonatomic)
+		mutex_unlock(&dev->write_mutex);
 	return ret;
 }
 
+/*
+ * The pointer follows the DMA from the residue: the frames sent from the
+ * ring are added to the ones the writer encoded before it, or taken from
+ * the ones the DMA callback encoded. Without BCM2708_I2S_NO_REWINDS the
+ * pointer of the callback stays at the frames taken from the ALSA buffer,
+ * a segment at a time, and the frames in the ring are reported as delay.
+ * The delay includes the frames in the I2S FIFO either way.
+ */
 static snd_pcm_uframes_t bcm2708_pcm_pointer(struct snd_pcm_substream *ss)
 {
 	struct bcm2708_i2s_dev *dev= ss->pcm->private_data;
-	return dev->pcm_pointer;
+	struct snd_pcm_runtime *runtime = ss->runtime;
+	snd_pcm_uframes_t pos;
+	unsigned int sent, unsent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	bcm2708_i2s_ring_pcm(dev, &sent, &unsent);
+	pos = dev->pcm_pointer;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (dev->ring_on_write) {
+		pos = (pos + sent) % runtime->buffer_size;
+		runtime->delay = BCM2708_I2S_FIFO_FRAMES;
+	} else if (BCM2708_I2S_NO_REWINDS) {
+		pos = (pos + runtime->buffer_size - unsent % runtime->buffer_size) %
+		      runtime->buffer_size;
+		runtime->delay = BCM2708_I2S_FIFO_FRAMES;
+	} else {
+		runtime->delay = unsent + BCM2708_I2S_FIFO_FRAMES;
+	}
+	return pos;
 }
 
+/*
+ * Link audio timestamps: the PCM frames that have left the I2S FIFO,
+ * from the DMA residue, with the system time taken under the same lock.
+ */
+static int bcm2708_pcm_get_time_info(struct snd_pcm_substream *ss,
+			struct timespec64 *system_ts, struct timespec64 *audio_ts,
+			struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+			struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct bcm2708_i2s_dev *dev = snd_pcm_substream_chip(ss);
+	struct snd_pcm_runtime *runtime = ss->runtime;
+	unsigned int sent, unsent;
+	unsigned long flags;
+	u64 frames;
+
+	if (audio_tstamp_config->type_requested != SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK) {
+		audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	spin_lock_irqsave(&dev->lock, flags);
+	snd_pcm_gettime(runtime, system_ts);
+	bcm2708_i2s_ring_pcm(dev, &sent, &unsent);
+	frames = dev->pcm_frames;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (dev->ring_on_write)
+		frames += sent;
+	else
+		frames -= min_t(u64, frames, unsent);
+	frames -= min_t(u64, frames, BCM2708_I2S_FIFO_FRAMES);
+	*audio_ts = ns_to_timespec64(div_u64(frames * NSEC_PER_SEC, runtime->rate));
+
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	audio_tstamp_report->accuracy_report = 1;
+	audio_tstamp_report->accuracy = div_u64((u64)BCM2708_I2S_FIFO_SLACK *
+						NSEC_PER_SEC, runtime->rate);
+	return 0;
+}
+
+/*
+ * Encoding at write time: frames written with write() are encoded in
+ * .copy, outside the stream lock, once they are in the ALSA buffer; frames
+ * committed through mmap are encoded in .ack. The PCM is then nonatomic,
+ * so .ack and the trigger run in process context under the stream mutex.
+ * Kernels that know SNDRV_PCM_INFO_NO_REWINDS refuse rewinds; on others,
+ * a rewind drops the queued frames and the writer encodes them again.
+ */
+static int bcm2708_pcm_ack(struct snd_pcm_substream *ss)
+{
+	struct bcm2708_i2s_dev *dev = snd_pcm_substream_chip(ss);
+
+	if (dev->ring_on_write) {
+		mutex_lock(&dev->write_mutex);
+		if (dev->running) {
+			if (bcm2708_i2s_rewound(dev))
+				bcm2708_i2s_drop_ring(dev, false);
+			bcm2708_i2s_write_committed(dev);
+		}
+		mutex_unlock(&dev->write_mutex);
+	}
+	return 0;
+}
+
+static void bcm2708_pcm_copied(struct bcm2708_i2s_dev *dev,
+			       unsigned long pos, unsigned long bytes)
+{
+	struct snd_pcm_runtime *runtime = dev->ss->runtime;
+
+	if (!dev->ring_on_write)
+		return;
+	mutex_lock(&dev->write_mutex);
+	if (dev->running &&
+	    bytes_to_frames(runtime, pos) == dev->encode_appl % runtime->buffer_size)
+		bcm2708_i2s_write_pcm(dev, bytes_to_frames(runtime, bytes));
+	mutex_unlock(&dev->write_mutex);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static int bcm2708_pcm_copy(struct snd_pcm_substream *ss, int channel,
+			    unsigned long pos, struct iov_iter *iter,
+			    unsigned long bytes)
+{
+	struct bcm2708_i2s_dev *dev = snd_pcm_substream_chip(ss);
+
+	if (copy_from_iter(ss->runtime->dma_area + pos, bytes, iter) != bytes)
+		return -EFAULT;
+	bcm2708_pcm_copied(dev, pos, bytes);
+	return 0;
+}
+#else
+static int bcm2708_pcm_copy_user(struct snd_pcm_substream *ss, int channel,
+				 unsigned long pos, void __user *buf,
+				 unsigned long bytes)
+{
+	struct bcm2708_i2s_dev *dev = snd_pcm_substream_chip(ss);
+
+	if (copy_from_user(ss->runtime->dma_area + pos, buf, bytes))
+		return -EFAULT;
+	bcm2708_pcm_copied(dev, pos, bytes);
+	return 0;
+}
+
+static int bcm2708_pcm_copy_kernel(struct snd_pcm_substream *ss, int channel,
+				   unsigned long pos, void *buf,
+				   unsigned long bytes)
+{
+	struct bcm2708_i2s_dev *dev = snd_pcm_substream_chip(ss);
+
+	memcpy(ss->runtime->dma_area + pos, buf, bytes);
+	bcm2708_pcm_copied(dev, pos, bytes);
+	return 0;
+}
+#endif
+
 static struct snd_pcm_ops bcm2708_i2s_pcm_ops = {
         .open      = bcm2708_pcm_open,
         .close     = bcm2708_pcm_close,
         .ioctl     = snd_pcm_lib_ioctl,
         .hw_params = bcm2708_hw_params,
-        .hw_free   = snd_pcm_lib_free_pages,
+        .hw_free   = bcm2708_hw_free,
         .prepare   = bcm2708_pcm_prepare,
         .trigger   = bcm2708_pcm_trigger,
         .pointer   = bcm2708_pcm_pointer,
+        .get_time_info = bcm2708_pcm_get_time_info,
+        .ack       = bcm2708_pcm_ack,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+        .copy      = bcm2708_pcm_copy,
+#else
+        .copy_user   = bcm2708_pcm_copy_user,
+        .copy_kernel = bcm2708_pcm_copy_kernel,
+#endif
 };
 
 /*
  * I2S interface
  */
 
-static void bcm2708_i2s_dma_complete(void *arg)
+/*
+ * Encodes frames PCM frames from the ALSA buffer at *pos, wrapping at its
+ * end, and advances *pos. From process context (may_sleep), large regions
+ * are encoded on several CPUs.
+ */
+static void bcm2708_i2s_encode_pcm(struct bcm2708_i2s_dev *dev, uint8_t *dst,
+				   unsigned int frames, snd_pcm_uframes_t *pos,
+				   bool may_sleep)
 {
-	struct bcm2708_i2s_dev *dev = arg;
+	struct snd_pcm_runtime *runtime = dev->ss->runtime;
+	const void *src;
+	unsigned int n;
+
+	for (; frames; frames -= n) {
+		n = min_t(snd_pcm_uframes_t, frames, runtime->buffer_size - *pos);
+		src = dev->ss->dma_buffer.area + frames_to_bytes(runtime, *pos);
+		if (may_sleep)
+			bcm2708_i2s_encode_ahead(dev, dst, src, n, dev->format);
+		else
+			spdif_encode_block(&dev->spdif, dst, src, n, dev->format);
+		dst += n * SPDIF_FRAMESIZE;
+		*pos += n;
+		if (*pos >= runtime->buffer_size)
+			*pos = 0;
+	}
+}
+
+/*
+ * Counts PCM frames sent and reports the periods that are complete, and
+ * with end the last of the frames written, so that ALSA sees a drain
+ * finish or an underrun, unless the application turned period wakeups
+ * off and follows the pointer with a timer. A nonatomic PCM takes the
+ * stream mutex to report, so the report is made from a work item.
+ */
+static void bcm2708_i2s_elapsed(struct bcm2708_i2s_dev *dev,
+				unsigned int frames, bool end)
+{
+	struct snd_pcm_runtime *runtime = dev->ss->runtime;
+
+	dev->period_frames += frames;
+	if (dev->period_frames < runtime->period_size && !end)
+		return;
+	dev->period_frames %= runtime->period_size;
+	if (runtime->no_period_wakeup)
+		return;
+	if (dev->pcm->nonatomic)
+		queue_work(system_highpri_wq, &dev->elapsed_work);
+	else
+		snd_pcm_period_elapsed(dev->ss);
+}
+
+static void bcm2708_i2s_elapsed_work_fn(struct work_struct *work)
+{
+	struct bcm2708_i2s_dev *dev =
+		container_of(work, struct bcm2708_i2s_dev, elapsed_work);
+	struct snd_pcm_substream *ss = READ_ONCE(dev->ss);
+
+	if (ss)
+		snd_pcm_period_elapsed(ss);
+}
+
+/*
+ * Refills the ring from the write cursor up to the segment the DMA is
+ * sending, as found from the residue. Normally that is the one segment
+ * sent since the last callback, but after a late or coalesced callback it
+ * covers every segment sent since, and a callback with nothing to refill
+ * writes nothing. Only frames up to appl_ptr are taken, the rest is
+ * silence, so the pointer never passes frames that were not written.
+ */
+static void bcm2708_i2s_refill_segments(struct bcm2708_i2s_dev *dev)
+{
+	struct snd_pcm_runtime *runtime;
 	struct dma_tx_state state;
-	int offset;
-	uint8_t *dst;
-	int i;
+	unsigned int segment_bytes, segment, frames, pcm = 0, sent = 0, taken = 0;
+	unsigned int n, p, f;
+	snd_pcm_sframes_t avail;
+	snd_pcm_uframes_t pos;
+	unsigned long flags;
+	bool silence, end;
+
+	if (dev->format == SPDIF_FORMAT_NONE) {
+		return;
+	}
+	dmaengine_tx_status(dev->i2s_dma, dev->i2s_dma_cookie, &state);
 
-	if (!dev->encode_frame) {
+	/* start of the segment being sent, which must not be written */
+	segment_bytes = dev->segment_frames * SPDIF_FRAMESIZE;
+	segment = (dev->ring_frames * SPDIF_FRAMESIZE - state.residue) / segment_bytes;
+	segment %= dev->segments;
+	frames = (segment * dev->segment_frames + dev->ring_frames -
+		  dev->ring_write) % dev->ring_frames;
+	if (frames == 0)
 		return;
+	if (frames > dev->segment_frames) {
+		dev->late_segments += frames / dev->segment_frames - 1;
+		dprintk(DBG_IRQ, "late callback: %u frames to refill\n", frames);
+	}
+
+	silence = atomic_add_unless(&dev->silence, frames / dev->segment_frames, 0) ||
+		  dev->ss == NULL || dev->paused;
+	if (!silence) {
+		/* only the frames the application has written, then silence */
+		runtime = dev->ss->runtime;
+		avail = READ_ONCE(runtime->control->appl_ptr) - dev->encode_appl;
+		if (avail < 0)
+			avail += runtime->boundary;
+		if (avail <= runtime->buffer_size)
+			pcm = min_t(snd_pcm_uframes_t, frames, avail);
 	}
+	end = !silence && pcm < frames;
+	pos = dev->pcm_pointer;
+	for (; frames; frames -= n) {
+		uint8_t *dst = dev->spdif_buffer + dev->ring_write * SPDIF_FRAMESIZE;
+
+		n = min(frames, dev->ring_frames - dev->ring_write);
+		p = min(n, pcm);
+		if (p)
+			bcm2708_i2s_encode_pcm(dev, dst, p, &pos, false);
+		if (n > p)
+			spdif_encode_silence(&dev->spdif, dst + p * SPDIF_FRAMESIZE,
+					     n - p);
+		bcm2708_i2s_sync_ring(dev, dev->ring_write, n);
+
+		/* the pointer and the delay follow the refilled segments */
+		spin_lock_irqsave(&dev->lock, flags);
+		for (f = 0; f < n; f += dev->segment_frames) {
+			segment = (dev->ring_write + f) / dev->segment_frames;
+			sent += dev->segment_pcm[segment];
+			dev->segment_pcm[segment] = min(p - min(p, f),
+							dev->segment_frames);
+			dev->segment_pcm_end[segment] = dev->segment_pcm[segment];
+		}
+		if (p) {
+			dev->pcm_pointer = pos;
+			dev->pcm_frames += p;
+			dev->encode_appl = (dev->encode_appl + p) %
+					   dev->ss->runtime->boundary;
+		}
+		dev->ring_write += n;
+		if (dev->ring_write >= dev->ring_frames)
+			dev->ring_write = 0;
+		dev->ring_ctr = dev->spdif.frame_ctr;
+		spin_unlock_irqrestore(&dev->lock, flags);
+		pcm -= p;
+		taken += p;
+	}
+
+	/* periods are counted where the pointer is */
+	pcm = BCM2708_I2S_NO_REWINDS ? sent : taken;
+	if (pcm && dev->ss)
+		bcm2708_i2s_elapsed(dev, pcm, end);
+}
+
+/* start of the segment being sent */
+static unsigned int bcm2708_i2s_ring_pos(struct bcm2708_i2s_dev *dev)
+{
+	struct dma_tx_state state;
+	unsigned int segment;
+
 	dmaengine_tx_status(dev->i2s_dma, dev->i2s_dma_cookie, &state);
+	segment = (dev->ring_frames * SPDIF_FRAMESIZE - state.residue) /
+		  (dev->segment_frames * SPDIF_FRAMESIZE);
+	return segment % dev->segments * dev->segment_frames;
+}
 
-	/* index of part of double buffer to fill */
-	offset = state.residue <= SPDIF_BUFSIZE / 2 ? 0 : SPDIF_BUFSIZE / 2;
-	dst = dev->spdif_buffer + offset;
+/* encodes silence into the ring, wrapping at its end */
+static void bcm2708_i2s_write_silence(struct bcm2708_i2s_dev *dev,
+				      unsigned int start, unsigned int frames,
+				      unsigned int ctr)
+{
+	unsigned int n;
+
+	dev->spdif_idle.frame_ctr = ctr;
+	for (; frames; frames -= n) {
+		n = min(frames, dev->ring_frames - start);
+		spdif_encode_silence(&dev->spdif_idle,
+				     dev->spdif_buffer + start * SPDIF_FRAMESIZE, n);
+		bcm2708_i2s_sync_ring(dev, start, n);
+		start = 0;
+	}
+}
 
-	if (atomic_inc_not_zero(&dev->silence)) {
-		const uint32_t zero[2] = {0, 0};
-		for (i = 0; i < SPDIF_BUFSIZE_FRAMES / 2; i++) {
-			dev->encode_frame(&dev->spdif, dst, zero);
-			dst += SPDIF_FRAMESIZE;
+/*
+ * Encodes run reserved frames of the ring from start, which must not
+ * wrap, and counts them as encoded. Called with write_mutex held.
+ */
+static void bcm2708_i2s_write_run(struct bcm2708_i2s_dev *dev,
+				  unsigned int start, unsigned int run,
+				  snd_pcm_uframes_t *pos)
+{
+	bcm2708_i2s_encode_pcm(dev, dev->spdif_buffer + start * SPDIF_FRAMESIZE,
+			       run, pos, true);
+	bcm2708_i2s_sync_ring(dev, start, run);
+	dev->encode_appl += run;
+	if (dev->encode_appl >= dev->ss->runtime->boundary)
+		dev->encode_appl -= dev->ss->runtime->boundary;
+}
+
+/*
+ * Encodes the next frames committed PCM frames into the ring, from the
+ * writer's context. Space is reserved one segment at a time under the
+ * lock and encoded outside it; the DMA callback does not write reserved
+ * frames and the DMA reaches them only after the frames queued before.
+ * The first segment, which the DMA may soon reach, is encoded on its
+ * own, the following ones together while they are contiguous in the
+ * ring, so that a large write or the committed buffer at start is
+ * encoded on several CPUs. Frames that do not fit are left for
+ * write_work. Called with write_mutex held.
+ */
+static void bcm2708_i2s_write_pcm(struct bcm2708_i2s_dev *dev,
+				  unsigned int frames)
+{
+	snd_pcm_uframes_t pos;
+	unsigned int start, n, first, segment, ctr;
+	unsigned int run_start = 0, run = 0;
+	bool batch = false;
+	unsigned long flags;
+
+	pos = dev->encode_appl % dev->ss->runtime->buffer_size;
+	for (; frames; frames -= n) {
+		spin_lock_irqsave(&dev->lock, flags);
+		start = dev->ring_write;
+		n = min3(frames, dev->segment_frames,
+			 dev->ring_frames - dev->ring_queued);
+		n = min(n, dev->ring_frames - start);
+		if (n == 0) {
+			dev->write_blocked = true;
+			spin_unlock_irqrestore(&dev->lock, flags);
+			dprintk(DBG_IRQ, "ring full, %u frames left\n", frames);
+			break;
 		}
-	} else if (dev->ss) {
-		ssize_t frame_bytes = frames_to_bytes(dev->ss->runtime, 1);
-		uint8_t *src = dev->ss->dma_buffer.area;
-		bool period_elapsed = false;
-
-		src += frames_to_bytes(dev->ss->runtime, dev->pcm_pointer);
-		for (i =0 ; i < SPDIF_BUFSIZE_FRAMES / 2; i++) {
-			dev->encode_frame(&dev->spdif, dst, src);
-			src += frame_bytes;
-			dst += SPDIF_FRAMESIZE;
+		ctr = dev->ring_ctr;
+		dev->ring_ctr = (ctr + n) % SPDIF_BLOCKSIZE;
+		dev->ring_write = (start + n) % dev->ring_frames;
+		dev->ring_queued += n;
+		/* a reservation covers at most two segments */
+		segment = start / dev->segment_frames;
+		first = min(n, (segment + 1) * dev->segment_frames - start);
+		dev->segment_pcm[segment] += first;
+		dev->segment_pcm_end[segment] = start % dev->segment_frames + first;
+		if (n > first) {
+			dev->segment_pcm[segment + 1] += n - first;
+			dev->segment_pcm_end[segment + 1] = n - first;
 		}
-		dev->pcm_pointer += SPDIF_BUFSIZE_FRAMES / 2;
-		if( dev->pcm_pointer >= dev->ss->runtime->buffer_size ){
-			dev->pcm_pointer -= dev->ss->runtime->buffer_size;
+		spin_unlock_irqrestore(&dev->lock, flags);
+
+		if (run && start != run_start + run) {
+			bcm2708_i2s_write_run(dev, run_start, run, &pos);
+			run = 0;
 		}
+		if (run == 0) {
+			run_start = start;
+			dev->spdif.frame_ctr = ctr;
+		}
+		run += n;
+		if (!batch) {
+			bcm2708_i2s_write_run(dev, run_start, run, &pos);
+			run = 0;
+			batch = true;
+		}
+	}
+	if (run)
+		bcm2708_i2s_write_run(dev, run_start, run, &pos);
+}
+
+/*
+ * Whether the application moved appl_ptr back over encoded frames with a
+ * rewind, or a write failed after .copy encoded its frames. Frames up to
+ * the end of the segment being sent are on their way to the line and
+ * cannot be replaced; the writer continues after them.
+ */
+static bool bcm2708_i2s_rewound(struct bcm2708_i2s_dev *dev)
+{
+	struct snd_pcm_runtime *runtime = dev->ss->runtime;
+	snd_pcm_sframes_t frames;
+
+	frames = runtime->control->appl_ptr - dev->encode_appl;
+	if (frames < 0)
+		frames += runtime->boundary;
+	return frames > runtime->buffer_size;
+}
+
+/*
+ * Encodes the frames committed up to appl_ptr that are not encoded yet.
+ * Called with write_mutex held.
+ */
+static void bcm2708_i2s_write_committed(struct bcm2708_i2s_dev *dev)
+{
+	struct snd_pcm_runtime *runtime = dev->ss->runtime;
+	snd_pcm_sframes_t frames;
+
+	frames = runtime->control->appl_ptr - dev->encode_appl;
+	if (frames < 0)
+		frames += runtime->boundary;
+	/* .copy encodes ahead of appl_ptr until the frames are committed */
+	if (frames == 0 || frames > runtime->buffer_size)
+		return;
+	bcm2708_i2s_write_pcm(dev, frames);
+}
+
+static void bcm2708_i2s_write_work_fn(struct work_struct *work)
+{
+	struct bcm2708_i2s_dev *dev =
+		container_of(work, struct bcm2708_i2s_dev, write_work);
+
+	mutex_lock(&dev->write_mutex);
+	if (dev->ss && dev->running)
+		bcm2708_i2s_write_committed(dev);
+	mutex_unlock(&dev->write_mutex);
+}
 
-		dev->period_frames += SPDIF_BUFSIZE_FRAMES / 2;
-		while (dev->period_frames >= dev->ss->runtime->period_size) {
-			dev->period_frames -= dev->ss->runtime->period_size;
-			period_elapsed = true;
+/*
+ * DMA callback when encoding at write time: moves the pointer over the
+ * PCM frames in the segments sent since the last callback and keeps
+ * SPDIF_RING_AHEAD_SEGMENTS filled, with silence if the writer has not
+ * provided them. Committed frames that did not fit into the ring are
+ * encoded by write_work in the room made.
+ */
+static void bcm2708_i2s_advance(struct bcm2708_i2s_dev *dev)
+{
+	unsigned int pos, sent, pcm = 0, silence = 0, start = 0, ctr = 0;
+	unsigned int f, segment, ahead, skip;
+	unsigned long flags;
+	bool blocked;
+
+	if (dev->format == SPDIF_FORMAT_NONE)
+		return;
+	pos = bcm2708_i2s_ring_pos(dev);
+
+	spin_lock_irqsave(&dev->lock, flags);
+	sent = (pos + dev->ring_frames - dev->ring_read) % dev->ring_frames;
+	for (f = dev->ring_read; f != pos; f = (f + dev->segment_frames) % dev->ring_frames) {
+		segment = f / dev->segment_frames;
+		pcm += dev->segment_pcm[segment];
+		dev->segment_pcm[segment] = 0;
+	}
+	dev->ring_read = pos;
+	if (sent + dev->segment_frames > dev->ring_queued) {
+		/*
+		 * The DMA is sending frames that were not written in time.
+		 * They still hold what was there one ring earlier: silence
+		 * goes in their place, from the write cursor or, if the DMA
+		 * has passed it, from the segment being sent, and the writer
+		 * continues after it.
+		 */
+		skip = (pos + dev->segment_frames + dev->ring_frames -
+			dev->ring_write) % dev->ring_frames;
+		dev->late_segments += DIV_ROUND_UP(skip, dev->segment_frames);
+		if (skip > dev->segment_frames) {
+			dev->ring_ctr = (dev->ring_ctr + skip - dev->segment_frames) %
+					SPDIF_BLOCKSIZE;
+			dev->ring_write = pos;
 		}
-		if (period_elapsed) {
-			snd_pcm_period_elapsed(dev->ss);
+		dev->ring_queued = (dev->ring_write + dev->ring_frames - pos) %
+				   dev->ring_frames;
+	} else {
+		dev->ring_queued -= sent;
+	}
+	if (pcm && dev->ss) {
+		dev->pcm_pointer = (dev->pcm_pointer + pcm) %
+				   dev->ss->runtime->buffer_size;
+		dev->pcm_frames += pcm;
+	}
+	ahead = SPDIF_RING_AHEAD_SEGMENTS * dev->segment_frames;
+	if (dev->ring_queued < ahead) {
+		silence = ahead - dev->ring_queued;
+		start = dev->ring_write;
+		ctr = dev->ring_ctr;
+		dev->ring_ctr = (ctr + silence) % SPDIF_BLOCKSIZE;
+		dev->ring_write = (start + silence) % dev->ring_frames;
+		dev->ring_queued += silence;
+	}
+	blocked = dev->write_blocked && sent;
+	if (blocked)
+		dev->write_blocked = false;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (blocked)
+		queue_work(system_highpri_wq, &dev->write_work);
+	if (silence)
+		bcm2708_i2s_write_silence(dev, start, silence, ctr);
+	if (sent)
+		atomic_add_unless(&dev->silence, sent / dev->segment_frames, 0);
+	if (pcm && dev->ss)
+		bcm2708_i2s_elapsed(dev, pcm, false);
+}
+
+/*
+ * Drops the frames queued after the segment being sent when encoding at
+ * write time, to be encoded again. On pause, silence is queued in their
+ * place, so that the frames of the whole ALSA buffer are not played out
+ * first; after a rewind the writer encodes the frames from appl_ptr in
+ * their place. The dropped frames are overwritten with silence either
+ * way, so that they do not play if the writer or the callback is late.
+ * The pointer only counts frames that were sent, so it does not move
+ * back. Called with write_mutex held.
+ */
+static void bcm2708_i2s_drop_ring(struct bcm2708_i2s_dev *dev, bool pause)
+{
+	unsigned int cut, keep, drop = 0, pcm = 0, segment, i;
+	unsigned int silence = 0, start, ctr, ahead;
+	snd_pcm_uframes_t boundary = dev->ss->runtime->boundary;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	cut = (bcm2708_i2s_ring_pos(dev) + dev->segment_frames) % dev->ring_frames;
+	keep = (cut + dev->ring_frames - dev->ring_read) % dev->ring_frames;
+	if (keep < dev->ring_queued) {
+		drop = dev->ring_queued - keep;
+		segment = cut / dev->segment_frames;
+		for (i = 0; i < DIV_ROUND_UP(drop, dev->segment_frames); i++) {
+			pcm += dev->segment_pcm[segment];
+			dev->segment_pcm[segment] = 0;
+			segment = (segment + 1) % dev->segments;
 		}
+		dev->encode_appl = (dev->encode_appl + boundary - pcm) % boundary;
+		dev->ring_ctr = (dev->ring_ctr + SPDIF_BLOCKSIZE -
+				 drop % SPDIF_BLOCKSIZE) % SPDIF_BLOCKSIZE;
+		dev->ring_write = cut;
+		dev->ring_queued = keep;
 	}
+	start = dev->ring_write;
+	ctr = dev->ring_ctr;
+	ahead = SPDIF_RING_AHEAD_SEGMENTS * dev->segment_frames;
+	if (pause && dev->ring_queued < ahead) {
+		silence = ahead - dev->ring_queued;
+		dev->ring_ctr = (ctr + silence) % SPDIF_BLOCKSIZE;
+		dev->ring_write = (start + silence) % dev->ring_frames;
+		dev->ring_queued += silence;
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	silence = max(silence, drop);
+	if (silence)
+		bcm2708_i2s_write_silence(dev, start, silence, ctr);
 }
 
-static int bcm2708_i2s_dmaengine_prepare_and_submit(struct bcm2708_i2s_dev *dev)
+static void bcm2708_i2s_refill(struct bcm2708_i2s_dev *dev)
 {
-	struct dma_async_tx_descriptor *desc;
+	/*
+	 * A callback of the ring that ran after the switch to the idle loop
+	 * or after the DMA was stopped, or while the trigger primes the
+	 * ring; the next callback refills.
+	 */
+	if (dev->idle || dev->i2s_dma_cookie <= 0 ||
+	    smp_load_acquire(&dev->priming))
+		return;
+	if (dev->ring_on_write)
+		bcm2708_i2s_advance(dev);
+	else
+		bcm2708_i2s_refill_segments(dev);
+}
 
-	if (dev->i2s_dma_cookie > 0) {
-		return 0;
-	} else if (dev->encode_frame) {
-		// Fill with silence
-		const uint32_t zero[2] = {0, 0};
-		uint8_t* dst = dev->spdif_buffer;
-		for (int i = 0; i < SPDIF_BUFSIZE_FRAMES; i++) {
-			dev->encode_frame(&dev->spdif, dst, zero);
-			dst += SPDIF_FRAMESIZE;
+static void bcm2708_i2s_dma_complete(void *arg)
+{
+	struct bcm2708_i2s_dev *dev = arg;
+
+	if (dev->encode_task) {
+		atomic_set(&dev->refill_pending, 1);
+		wake_up_process(dev->encode_task);
+	} else {
+		bcm2708_i2s_refill(dev);
+	}
+}
+
+/*
+ * Encoder thread: refills the ring when the DMA callback wakes it, so that
+ * the encoding does not run in softirq context and delay other softirqs.
+ */
+static int bcm2708_i2s_encode_thread(void *data)
+{
+	struct bcm2708_i2s_dev *dev = data;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_xchg(&dev->refill_pending, 0)) {
+			schedule();
+			continue;
 		}
+		__set_current_state(TASK_RUNNING);
+		mutex_lock(&dev->refill_mutex);
+		bcm2708_i2s_refill(dev);
+		mutex_unlock(&dev->refill_mutex);
 	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void bcm2708_i2s_start_encode_thread(struct bcm2708_i2s_dev *dev)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = SCHED_FIFO,
+		.sched_priority = min_t(unsigned int, encode_thread_prio,
+					MAX_RT_PRIO - 1),
+	};
+	struct task_struct *task;
+	int ret;
+
+	if (encode_thread_prio == 0)
+		return;
+	task = kthread_create(bcm2708_i2s_encode_thread, dev, "spdif-enc");
+	if (IS_ERR(task)) {
+		dev_warn(dev->dev, "cannot create the encoder thread: %ld\n",
+			 PTR_ERR(task));
+		return;
+	}
+	if (encode_thread_cpu >= 0) {
+		if (encode_thread_cpu < nr_cpu_ids && cpu_possible(encode_thread_cpu))
+			kthread_bind(task, encode_thread_cpu);
+		else
+			dev_warn(dev->dev, "invalid encoder thread CPU %d\n",
+				 encode_thread_cpu);
+	}
+	/* sched_setscheduler_nocheck() is not exported to modules */
+	ret = sched_setattr_nocheck(task, &attr);
+	dev->encode_task = task;
+	wake_up_process(task);
+	if (ret)
+		dev_warn(dev->dev, "cannot make the encoder thread SCHED_FIFO: %d\n",
+			 ret);
+	else
+		dev_info(dev->dev, "encoding in a SCHED_FIFO thread, priority %u\n",
+			 attr.sched_priority);
+}
+
+static void bcm2708_i2s_stop_encode_thread(struct bcm2708_i2s_dev *dev)
+{
+	if (dev->encode_task == NULL)
+		return;
+	kthread_stop(dev->encode_task);
+	dev->encode_task = NULL;
+}
+
+/* encodes silence into the ring from start, which must not wrap */
+static void bcm2708_i2s_fill_ring(struct bcm2708_i2s_dev *dev,
+				  unsigned int start, unsigned int frames,
+				  bool may_sleep)
+{
+	uint8_t *dst = dev->spdif_buffer + start * SPDIF_FRAMESIZE;
+
+	if (may_sleep)
+		bcm2708_i2s_encode_ahead(dev, dst, NULL, frames,
+					 SPDIF_FORMAT_NONE);
+	else
+		spdif_encode_silence(&dev->spdif, dst, frames);
+	bcm2708_i2s_sync_ring(dev, start, frames);
+}
+
+/* frame of the ring that the DMA sends next, from the residue */
+static unsigned int bcm2708_i2s_dma_frame(struct bcm2708_i2s_dev *dev)
+{
+	struct dma_tx_state state;
+
+	dmaengine_tx_status(dev->i2s_dma, dev->i2s_dma_cookie, &state);
+	return (dev->ring_frames * SPDIF_FRAMESIZE - state.residue) /
+	       SPDIF_FRAMESIZE % dev->ring_frames;
+}
+
+/*
+ * Frame of the block at ring frame pos, from the frame counter where the
+ * ring was last written. The refill moves the write cursor and the
+ * counter together under the lock, so the ring may be running.
+ */
+static unsigned int bcm2708_i2s_ring_ctr(struct bcm2708_i2s_dev *dev,
+					 unsigned int pos)
+{
+	unsigned int ahead, ctr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	/* frames encoded from pos up to the write cursor */
+	ahead = (dev->ring_write + dev->ring_frames - pos) % dev->ring_frames;
+	/* the callback keeps the whole ring encoded */
+	if (!dev->ring_on_write && ahead == 0)
+		ahead = dev->ring_frames;
+	ctr = dev->ring_ctr;
+	spin_unlock_irqrestore(&dev->lock, flags);
+	return (ctr + SPDIF_BLOCKSIZE - ahead % SPDIF_BLOCKSIZE) % SPDIF_BLOCKSIZE;
+}
 
-	desc = dmaengine_prep_dma_cyclic(dev->i2s_dma,
-			dev->spdif_buffer_handle,
-			SPDIF_BUFSIZE,
-			SPDIF_BUFSIZE / 2,
-			DMA_MEM_TO_DEV,
-			DMA_CTRL_ACK|DMA_PREP_INTERRUPT);
+/*
+ * Frame of the block the DMA sends next, from the residue of the idle
+ * loop or of the ring.
+ */
+static unsigned int bcm2708_i2s_dma_ctr(struct bcm2708_i2s_dev *dev)
+{
+	struct dma_tx_state state;
+
+	if (!dev->idle)
+		return bcm2708_i2s_ring_ctr(dev, bcm2708_i2s_dma_frame(dev));
+	dmaengine_tx_status(dev->i2s_dma, dev->i2s_dma_cookie, &state);
+	return (dev->idle_ctr + (SPDIF_IDLE_BYTES - state.residue) /
+		SPDIF_FRAMESIZE) % SPDIF_BLOCKSIZE;
+}
 
+/*
+ * Waits for the callbacks of the transfers stopped without waiting and
+ * for a refill by the encoder thread, so that the ring can be written or
+ * freed. The idle loop has no callbacks and keeps running.
+ */
+static void bcm2708_i2s_sync_dma(struct bcm2708_i2s_dev *dev)
+{
+	dmaengine_synchronize(dev->i2s_dma);
+	if (dev->i2s_dma_spare)
+		dmaengine_synchronize(dev->i2s_dma_spare);
+	mutex_lock(&dev->refill_mutex);
+	mutex_unlock(&dev->refill_mutex);
+}
+
+/* stops the DMA on the ring, see bcm2708_i2s_sync_dma() */
+static void bcm2708_i2s_stop_ring(struct bcm2708_i2s_dev *dev)
+{
+	dmaengine_terminate_sync(dev->i2s_dma);
+	dev->i2s_dma_cookie = 0;
+	bcm2708_i2s_sync_dma(dev);
+}
+
+/*
+ * Prepares and submits a cyclic transfer on chan: the ring, with a
+ * callback for every segment, or the idle loop from frame ctr of the
+ * block. Returns its cookie, for bcm2708_i2s_switch_dma() to start.
+ */
+static dma_cookie_t bcm2708_i2s_submit_dma(struct bcm2708_i2s_dev *dev,
+					   struct dma_chan *chan, bool ring,
+					   unsigned int ctr)
+{
+	struct dma_async_tx_descriptor *desc;
+
+	if (ring)
+		desc = dmaengine_prep_dma_cyclic(chan, dev->spdif_buffer_handle,
+				dev->ring_frames * SPDIF_FRAMESIZE,
+				dev->segment_frames * SPDIF_FRAMESIZE,
+				DMA_MEM_TO_DEV,
+				DMA_CTRL_ACK|DMA_PREP_INTERRUPT);
+	else
+		desc = dmaengine_prep_dma_cyclic(chan,
+				dev->idle_handle + ctr * SPDIF_FRAMESIZE,
+				SPDIF_IDLE_BYTES, SPDIF_IDLE_BYTES,
+				DMA_MEM_TO_DEV, DMA_CTRL_ACK);
 	if (!desc)
 		return -ENOMEM;
+	if (ring) {
+		desc->callback = bcm2708_i2s_dma_complete;
+		desc->callback_param = dev;
+	}
+	return dmaengine_submit(desc);
+}
 
-	desc->callback = bcm2708_i2s_dma_complete;
-	desc->callback_param = dev;
-	dev->i2s_dma_cookie = dmaengine_submit(desc);
-	dma_async_issue_pending(dev->i2s_dma);
+/*
+ * Replaces the transfer the DMA runs, if any, with the ring or with the
+ * idle loop from frame ctr of the block. A cookie submitted beforehand on
+ * the spare channel is started there and the channels swap roles;
+ * otherwise the transfer is prepared here, once the old one is stopped,
+ * which drops whatever was prepared on its channel. Called with
+ * interrupts off, so that the frames in the I2S FIFO cover the switch.
+ * The callbacks of the old transfer are not waited for, see
+ * bcm2708_i2s_sync_dma().
+ */
+static int bcm2708_i2s_switch_dma(struct bcm2708_i2s_dev *dev, bool ring,
+				  unsigned int ctr, dma_cookie_t cookie)
+{
+	struct dma_chan *chan = dev->i2s_dma;
+
+	if (dev->i2s_dma_cookie > 0)
+		dmaengine_terminate_async(dev->i2s_dma);
+	if (cookie > 0) {
+		chan = dev->i2s_dma_spare;
+		dev->i2s_dma_spare = dev->i2s_dma;
+		dev->i2s_dma = chan;
+	} else {
+		cookie = bcm2708_i2s_submit_dma(dev, chan, ring, ctr);
+	}
+	if (cookie < 0) {
+		dev->i2s_dma_cookie = 0;
+		return cookie;
+	}
+	dev->i2s_dma_cookie = cookie;
+	dma_async_issue_pending(chan);
+	return 0;
+}
+
+/*
+ * Switches the DMA to the idle loop: one block of silence, sent over and
+ * over without interrupts, keeps the receiver locked while there is no
+ * stream. It continues the block the ring was sending. When preparing,
+ * the block is encoded again if the channel status has changed;
+ * TRIGGER_STOP loops the block of the last prepare.
+ */
+static int bcm2708_i2s_start_idle(struct bcm2708_i2s_dev *dev, bool prepare)
+{
+	unsigned int ctr = 0;
+	unsigned long flags;
+	u64 t;
+	int ret;
+
+	if (prepare && !dev->idle_encoded) {
+		dev->spdif.frame_ctr = 0;
+		spdif_encode_silence(&dev->spdif, dev->idle_buffer,
+				     2 * SPDIF_BLOCKSIZE);
+		if (dev->ring_mem == RING_MEM_CACHED)
+			dma_sync_single_for_device(dev->dev, dev->idle_handle,
+						   SPDIF_IDLE_ALLOC_BYTES,
+						   DMA_TO_DEVICE);
+		dev->idle_encoded = true;
+	}
+	if (dev->i2s_dma_cookie > 0 && dev->idle)
+		return 0;
+
+	local_irq_save(flags);
+	t = ktime_get_ns();
+	if (dev->i2s_dma_cookie > 0)
+		ctr = bcm2708_i2s_dma_ctr(dev);
+	/* later callbacks of the ring see idle and return */
+	dev->idle = true;
+	dev->idle_ctr = ctr;
+	ret = bcm2708_i2s_switch_dma(dev, false, ctr, 0);
+	if (ret)
+		dev->idle = false;
+	t = ktime_get_ns() - t;
+	local_irq_restore(flags);
+	dprintk(DBG_ALSA, "switch to the idle loop: %llu ns\n", t);
+	return ret;
+}
+
+/*
+ * Encodes PCM frames from the ALSA buffer at *pos into the ring, which
+ * must not wrap, for the DMA callback to continue after them.
+ */
+static void bcm2708_i2s_prime_pcm(struct bcm2708_i2s_dev *dev,
+				  unsigned int start, unsigned int frames,
+				  snd_pcm_uframes_t *pos, bool may_sleep)
+{
+	bcm2708_i2s_encode_pcm(dev, dev->spdif_buffer + start * SPDIF_FRAMESIZE,
+			       frames, pos, may_sleep);
+	bcm2708_i2s_sync_ring(dev, start, frames);
+}
+
+/*
+ * Starts the DMA on the ring, from its first frame, continuing the block
+ * of the idle loop, with the frames the application has provided so far
+ * placed to end where the DMA callback or the writer continues: the
+ * silence ahead of the callback or the writer is cut short by as many
+ * frames, so with enough of them the first sample follows the frames in
+ * the I2S FIFO. With a spare channel the transfer is set up beforehand.
+ * The frame the idle loop is at is read with interrupts off, and only
+ * SPDIF_IDLE_SWITCH_FRAMES are encoded before the switch; the rest is
+ * encoded while the DMA sends them, as the encoder is far faster than
+ * the line.
+ */
+static int bcm2708_i2s_dmaengine_prepare_and_submit(struct bcm2708_i2s_dev *dev)
+{
+	snd_pcm_uframes_t pos = dev->pcm_pointer;
+	unsigned int ctr, fill, pcm, lead, first, end, s;
+	bool may_sleep = dev->pcm->nonatomic;
+	dma_cookie_t cookie = 0;
+	unsigned long flags;
+	u64 t;
+	int ret;
+
+	/* callbacks of the new ring leave it to the trigger until primed */
+	dev->priming = true;
+	if (dev->i2s_dma_spare)
+		cookie = bcm2708_i2s_submit_dma(dev, dev->i2s_dma_spare, true, 0);
+	/* the DMA only gets past the writer's frames after a callback */
+	fill = dev->ring_on_write ?
+	       SPDIF_RING_AHEAD_SEGMENTS * dev->segment_frames :
+	       dev->ring_frames;
+	pcm = min_t(snd_pcm_uframes_t, fill,
+		    snd_pcm_playback_hw_avail(dev->ss->runtime));
+	first = min_t(unsigned int, fill, SPDIF_IDLE_SWITCH_FRAMES);
+	lead = fill - pcm;
+
+	local_irq_save(flags);
+	t = ktime_get_ns();
+	ctr = dev->i2s_dma_cookie > 0 ? bcm2708_i2s_dma_ctr(dev) :
+	      dev->spdif.frame_ctr;
+	dev->spdif.frame_ctr = ctr;
+	spin_lock(&dev->lock);
+	memset(dev->segment_pcm, 0, 2 * dev->segments * sizeof(*dev->segment_pcm));
+	if (dev->ring_on_write) {
+		/* the writer's frames follow the silence in the ring */
+		dev->ring_read = 0;
+		dev->write_blocked = false;
+		dev->ring_queued = lead;
+		dev->ring_write = lead;
+		dev->ring_ctr = (ctr + lead) % SPDIF_BLOCKSIZE;
+	} else {
+		/* the primed frames end with the ring, taken as a refill */
+		for (s = 0; s < dev->segments; s++) {
+			end = (s + 1) * dev->segment_frames;
+			dev->segment_pcm[s] = end > lead ?
+				min(end - lead, dev->segment_frames) : 0;
+			dev->segment_pcm_end[s] = dev->segment_frames;
+		}
+		dev->pcm_pointer = (pos + pcm) % dev->ss->runtime->buffer_size;
+		dev->pcm_frames += pcm;
+		dev->encode_appl = pcm;
+		if (!BCM2708_I2S_NO_REWINDS)
+			dev->period_frames += pcm;
+		dev->ring_write = 0;
+		dev->ring_ctr = (ctr + dev->ring_frames) % SPDIF_BLOCKSIZE;
+	}
+	spin_unlock(&dev->lock);
+
+	bcm2708_i2s_fill_ring(dev, 0, min(first, lead), false);
+	if (first > lead) {
+		if (dev->ring_on_write)
+			bcm2708_i2s_write_pcm(dev, first - lead);
+		else
+			bcm2708_i2s_prime_pcm(dev, lead, first - lead, &pos,
+					      false);
+	}
+	ret = bcm2708_i2s_switch_dma(dev, true, 0, max(cookie, 0));
+	dev->idle = false;
+	t = ktime_get_ns() - t;
+	local_irq_restore(flags);
+	dprintk(DBG_ALSA, "switch to the ring: %llu ns\n", t);
+	if (ret) {
+		dev->priming = false;
+		return ret;
+	}
+
+	if (lead > first)
+		bcm2708_i2s_fill_ring(dev, first, lead - first, may_sleep);
+	first = max(first, lead);
+	/* the writer encodes its frames when the trigger calls it */
+	if (fill > first && !dev->ring_on_write)
+		bcm2708_i2s_prime_pcm(dev, first, fill - first, &pos, may_sleep);
+	smp_store_release(&dev->priming, false);
 	return 0;
 }
 
@@ -552,6 +2090,170 @@ static const struct regmap_config bcm2708_regmap_config = {
 	.cache_type = REGCACHE_RBTREE,
 };
 
+/* encoder benchmark: best of ENCODER_BENCH_RUNS runs over the DMA buffer */
+#define ENCODER_BENCH_RUNS	4
+#define ENCODER_BENCH_LOOPS	4
+#define ENCODER_BENCH_FRAMES	SPDIF_RING_MIN_FRAMES
+#define ENCODER_BENCH_PCM_SIZE	(ENCODER_BENCH_FRAMES * 4)	/* S16_LE */
+#define ENCODER_SELFTEST_ROUNDS	16
+
+static bool bcm2708_i2s_encoder_ok(struct bcm2708_i2s_dev *dev,
+				   const struct spdif_encoder_impl *impl)
+{
+	uint32_t seed;
+	int ret;
+
+	if (impl->usable && !impl->usable())
+		return false;
+	get_random_bytes(&seed, sizeof(seed));
+	ret = spdif_encoder_selftest(impl, ENCODER_SELFTEST_ROUNDS, seed);
+	if (ret) {
+		dev_err(dev->dev, "encoder %s failed the self-test: %d (seed %u)\n",
+			impl->name, ret, seed);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Selects the block encoder, like the raid6 and xor code pick their
+ * routines at load time: every encoder usable on this CPU encodes random
+ * S16_LE samples into the DMA buffer and the fastest one is used. The
+ * encoder module parameter skips the benchmark. Encoders that fail the
+ * self-test are not used.
+ */
+static void bcm2708_i2s_select_encoder(struct bcm2708_i2s_dev *dev)
+{
+	const struct spdif_encoder_impl *const *impl;
+	const struct spdif_encoder_impl *best = NULL;
+	u64 best_ns = U64_MAX, ns, start;
+	void *pcm;
+	int run, i;
+
+	if (encoder && *encoder) {
+		best = spdif_encoder_find_impl(encoder);
+		if (best && bcm2708_i2s_encoder_ok(dev, best)) {
+			spdif_encoder_set_impl(&dev->spdif, best);
+			dev_info(dev->dev, "using encoder %s\n", best->name);
+			return;
+		}
+		dev_warn(dev->dev, "encoder %s not available\n", encoder);
+		best = NULL;
+	}
+
+	pcm = kmalloc(ENCODER_BENCH_PCM_SIZE, GFP_KERNEL);
+	if (pcm == NULL)
+		return; /* keep the default encoder */
+	get_random_bytes(pcm, ENCODER_BENCH_PCM_SIZE);
+
+	for (impl = spdif_encoder_impls; *impl; impl++) {
+		if (!bcm2708_i2s_encoder_ok(dev, *impl))
+			continue;
+		spdif_encoder_set_impl(&dev->spdif, *impl);
+		ns = U64_MAX;
+		for (run = 0; run < ENCODER_BENCH_RUNS; run++) {
+			preempt_disable();
+			start = ktime_get_ns();
+			for (i = 0; i < ENCODER_BENCH_LOOPS; i++)
+				spdif_encode_block(&dev->spdif, dev->spdif_buffer,
+						   pcm, ENCODER_BENCH_FRAMES,
+						   SPDIF_FORMAT_S16_LE);
+			ns = min(ns, ktime_get_ns() - start);
+			preempt_enable();
+		}
+		dev_info(dev->dev, "encoder %-6s: %llu ns/frame\n", (*impl)->name,
+			 div_u64(ns, ENCODER_BENCH_LOOPS * ENCODER_BENCH_FRAMES));
+		if (ns < best_ns) {
+			best_ns = ns;
+			best = *impl;
+		}
+	}
+	kfree(pcm);
+
+	dev->spdif.frame_ctr = 0;
+	if (best == NULL) {
+		/* keep the default encoder, the benchmark overwrote impl */
+		spdif_encoder_set_impl(&dev->spdif, spdif_encoder_find_impl("block"));
+		dev_err(dev->dev, "no encoder passed the self-test\n");
+		return;
+	}
+	spdif_encoder_set_impl(&dev->spdif, best);
+	dev_info(dev->dev, "using encoder %s\n", best->name);
+}
+
+/*
+ * Selects the memory of the encoded ring: the default encoder encodes
+ * random S16_LE samples into a buffer of each kind, including the sync
+ * for the DMA, and the fastest kind is used. Whether coherent memory is
+ * uncached, bufferable or cached depends on the SoC and the kernel, so
+ * it is measured rather than assumed. The ring_memory module parameter
+ * skips the benchmark.
+ */
+static void bcm2708_i2s_select_ring_memory(struct bcm2708_i2s_dev *dev)
+{
+	const size_t size = ENCODER_BENCH_FRAMES * SPDIF_FRAMESIZE;
+	enum bcm2708_i2s_ring_mem mem, best = RING_MEM_COHERENT;
+	u64 best_ns = U64_MAX, ns, start;
+	dma_addr_t handle;
+	void *pcm, *buffer;
+	int run, i;
+
+	if (ring_memory && *ring_memory) {
+		for (mem = 0; mem < RING_MEM_COUNT; mem++) {
+			if (strcmp(ring_memory, bcm2708_i2s_ring_mem_names[mem]) == 0)
+				break;
+		}
+		if (mem < RING_MEM_COUNT) {
+			dev->ring_mem = mem;
+			dev_info(dev->dev, "using %s ring memory\n",
+				 bcm2708_i2s_ring_mem_names[mem]);
+			return;
+		}
+		dev_warn(dev->dev, "ring memory %s not available\n", ring_memory);
+	}
+
+	dev->ring_mem = RING_MEM_COHERENT;
+	pcm = kmalloc(ENCODER_BENCH_PCM_SIZE, GFP_KERNEL);
+	if (pcm == NULL)
+		return;
+	get_random_bytes(pcm, ENCODER_BENCH_PCM_SIZE);
+
+	for (mem = 0; mem < RING_MEM_COUNT; mem++) {
+		buffer = bcm2708_i2s_ring_mem_alloc(dev, mem, size, &handle);
+		if (buffer == NULL)
+			continue;
+		ns = U64_MAX;
+		for (run = 0; run < ENCODER_BENCH_RUNS; run++) {
+			preempt_disable();
+			start = ktime_get_ns();
+			for (i = 0; i < ENCODER_BENCH_LOOPS; i++) {
+				spdif_encode_block(&dev->spdif, buffer, pcm,
+						   ENCODER_BENCH_FRAMES,
+						   SPDIF_FORMAT_S16_LE);
+				if (mem == RING_MEM_CACHED)
+					dma_sync_single_for_device(dev->dev, handle,
+								   size, DMA_TO_DEVICE);
+			}
+			ns = min(ns, ktime_get_ns() - start);
+			preempt_enable();
+		}
+		bcm2708_i2s_ring_mem_free(dev, mem, size, buffer, handle);
+		dev_info(dev->dev, "ring memory %-8s: %llu ns/frame\n",
+			 bcm2708_i2s_ring_mem_names[mem],
+			 div_u64(ns, ENCODER_BENCH_LOOPS * ENCODER_BENCH_FRAMES));
+		if (ns < best_ns) {
+			best_ns = ns;
+			best = mem;
+		}
+	}
+	kfree(pcm);
+
+	dev->spdif.frame_ctr = 0;
+	dev->ring_mem = best;
+	dev_info(dev->dev, "using %s ring memory\n",
+		 bcm2708_i2s_ring_mem_names[best]);
+}
+
 static int bcm2708_i2s_probe(struct platform_device *pdev)
 {
 	struct bcm2708_i2s_dev *dev;
@@ -593,18 +2295,23 @@ static int bcm2708_i2s_probe(struct platform_device *pdev)
 		goto out_devm_kzalloc;
 	}
 	spin_lock_init(&dev->lock);
-	dev->spdif_buffer = dma_alloc_coherent(
-		dev->dev,
-		SPDIF_FRAMESIZE*SPDIF_BUFSIZE_FRAMES,
-		&dev->spdif_buffer_handle,
-		GFP_KERNEL);
-	if (dev->spdif_buffer == NULL) {
+	mutex_init(&dev->refill_mutex);
+	mutex_init(&dev->write_mutex);
+	INIT_WORK(&dev->elapsed_work, bcm2708_i2s_elapsed_work_fn);
+	INIT_WORK(&dev->write_work, bcm2708_i2s_write_work_fn);
+	spdif_encoder_init(&dev->spdif);
+	bcm2708_i2s_select_ring_memory(dev);
+	if (bcm2708_i2s_alloc_ring(dev, SPDIF_RING_MIN_FRAMES) ||
+	    bcm2708_i2s_alloc_idle(dev)) {
 		dev_err(&pdev->dev, "cannot allocate DMA memory.\n");
+		bcm2708_i2s_free_ring(dev);
 		ret = -ENOMEM;
 		goto out_devm_kzalloc;
 	}
 
-	spdif_encoder_init(&dev->spdif);
+	bcm2708_i2s_select_encoder(dev);
+	bcm2708_i2s_init_encode_work(dev);
+	bcm2708_i2s_start_encode_thread(dev);
 
 	/* get the DMA address from the DT */
 	addr = of_get_address(pdev->dev.of_node, 0, NULL, NULL);
@@ -644,9 +2351,20 @@ static int bcm2708_i2s_probe(struct platform_device *pdev)
 	if( ret < 0 ){
 		dev_err(&pdev->dev,
 		        "could not configure DMA channel: %d.\n", ret);
-		goto out_dma_alloc;
+		goto out_dma_chan;
 	}
 
+	/* the ring's transfer is set up on a second channel ahead of a switch */
+	dev->i2s_dma_spare = dma_request_slave_channel_compat(mask, NULL, NULL,
+							      &pdev->dev, "tx");
+	if (dev->i2s_dma_spare &&
+	    dmaengine_slave_config(dev->i2s_dma_spare, &slave_config) < 0) {
+		dma_release_channel(dev->i2s_dma_spare);
+		dev->i2s_dma_spare = NULL;
+	}
+	if (dev->i2s_dma_spare == NULL)
+		dev_info(&pdev->dev, "no spare DMA channel\n");
+
 	/*
 	 * register ALSA driver
 	*/
@@ -654,7 +2372,7 @@ static int bcm2708_i2s_probe(struct platform_device *pdev)
 			  THIS_MODULE, 0, &dev->card);
 	if( ret<0 ){
 		dev_err(&pdev->dev, "could not create ALSA card: %d\n", ret);
-		goto out_dma_alloc;
+		goto out_dma_chan;
 	}
 	strcpy(dev->card->driver, "rpi_spdif_drv");
 	strcpy(dev->card->shortname, "RPI I2S SPDIF");
@@ -672,16 +2390,23 @@ static int bcm2708_i2s_probe(struct platform_device *pdev)
 		goto out_card_create;
 	}
 	dev->pcm->private_data= dev;
+	/*
+	 * The writer encodes from .ack and the trigger, which may take long.
+	 * The DMA callback reports periods directly only to an atomic PCM.
+	 */
+	dev->pcm->nonatomic = encode_on_write;
 	strcpy(dev->pcm->name, "spdif");
 	snd_pcm_set_ops(dev->pcm,
 			SNDRV_PCM_STREAM_PLAYBACK,
 			&bcm2708_i2s_pcm_ops);
 
+	dev->pcm_buffer_bytes = clamp_t(unsigned int, pcm_buffer_kb, 1,
+					PCM_BUFFER_KB_MAX) * 1024;
 	snd_pcm_lib_preallocate_pages_for_all(
 		dev->pcm,
-		SNDRV_DMA_TYPE_CONTINUOUS,
+		SNDRV_DMA_TYPE_VMALLOC,
 		NULL,
-		PCM_BUFSIZE, PCM_BUFSIZE);
+		dev->pcm_buffer_bytes, dev->pcm_buffer_bytes);
 	ret = snd_card_register(dev->card);
 	if( ret<0 ){
 		dev_err(&pdev->dev, "could not register ALSA card:%d\n", ret);
@@ -702,7 +2427,7 @@ static int bcm2708_i2s_probe(struct platform_device *pdev)
 	regmap_update_bits(dev->i2s_regmap, BCM2708_I2S_DREQ_A_REG,
 			  BCM2708_I2S_TX_PANIC(0x10)
 			| BCM2708_I2S_RX_PANIC(0x30)
-			| BCM2708_I2S_TX(0x30)
+			| BCM2708_I2S_TX(BCM2708_I2S_TX_DREQ)
 			| BCM2708_I2S_RX(0x20), 0xffffffff);
 
 	/* initialize and start the clock */
@@ -755,11 +2480,14 @@ static int bcm2708_i2s_probe(struct platform_device *pdev)
 
 out_card_create:
 	snd_card_free(dev->card);
+out_dma_chan:
+	if (dev->i2s_dma_spare)
+		dma_release_channel(dev->i2s_dma_spare);
+	dma_release_channel(dev->i2s_dma);
 out_dma_alloc:
-	dma_free_coherent(dev->dev,
-			  SPDIF_FRAMESIZE * SPDIF_BUFSIZE_FRAMES,
-			  dev->spdif_buffer,
-			  dev->spdif_buffer_handle);
+	bcm2708_i2s_stop_encode_thread(dev);
+	bcm2708_i2s_free_encode_work(dev);
+	bcm2708_i2s_free_ring(dev);
 out_devm_kzalloc:
 	devm_kfree(&pdev->dev, dev);
 	return ret;
@@ -770,13 +2498,20 @@ static int bcm2708_i2s_remove(struct platform_device *pdev)
 	struct bcm2708_i2s_dev *dev;
 	dev= dev_get_drvdata(&pdev->dev);
 
-	dmaengine_terminate_all(dev->i2s_dma);
+	dmaengine_terminate_sync(dev->i2s_dma);
 	dma_release_channel(dev->i2s_dma);
+	if (dev->i2s_dma_spare) {
+		dmaengine_terminate_sync(dev->i2s_dma_spare);
+		dma_release_channel(dev->i2s_dma_spare);
+	}
+	if (dev->clk_enabled)
+		clk_disable_unprepare(dev->clk);
 	snd_card_free(dev->card);
-	dma_free_coherent(dev->dev,
-			  SPDIF_FRAMESIZE * SPDIF_BUFSIZE_FRAMES,
-			  dev->spdif_buffer,
-			  dev->spdif_buffer_handle);
+	cancel_work_sync(&dev->elapsed_work);
+	cancel_work_sync(&dev->write_work);
+	bcm2708_i2s_stop_encode_thread(dev);
+	bcm2708_i2s_free_encode_work(dev);
+	bcm2708_i2s_free_ring(dev);
 	devm_kfree(&pdev->dev, dev);
 	dprintk(DBG_INIT, "driver unloaded.\n");
 	return 0;
@@ -0,0 +1,25 @@
+/*
+ * Userspace replacement for <linux/bug.h>. Failed checks abort.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __SPDIF_COMPAT_LINUX_BUG_H__
+#define __SPDIF_COMPAT_LINUX_BUG_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WARN_ON_ONCE(cond) ({						\
+	bool __c = !!(cond);						\
+	if (__c) {							\
+		fprintf(stderr, "%s:%d: WARN_ON_ONCE(%s)\n",		\
+			__FILE__, __LINE__, #cond);			\
+		abort();						\
+	}								\
+	__c;								\
+})
+
+#endif
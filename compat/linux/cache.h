@@ -0,0 +1,21 @@
+/*
+ * Userspace replacement for <linux/cache.h>, used to build the encoder
+ * outside of the kernel.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __SPDIF_COMPAT_LINUX_CACHE_H__
+#define __SPDIF_COMPAT_LINUX_CACHE_H__
+
+#ifndef SMP_CACHE_BYTES
+#define SMP_CACHE_BYTES 64
+#endif
+
+#ifndef ____cacheline_aligned
+#define ____cacheline_aligned __attribute__((__aligned__(SMP_CACHE_BYTES)))
+#endif
+
+#endif
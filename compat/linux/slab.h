@@ -0,0 +1,30 @@
+/*
+ * Userspace replacement for <linux/slab.h>, used to build the encoder
+ * outside of the kernel.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __SPDIF_COMPAT_LINUX_SLAB_H__
+#define __SPDIF_COMPAT_LINUX_SLAB_H__
+
+#include <stdlib.h>
+
+#define GFP_KERNEL 0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+	void *p;
+
+	(void)flags;
+	return posix_memalign(&p, 64, size) ? NULL : p;
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * Userspace replacement for <linux/string.h>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __SPDIF_COMPAT_LINUX_STRING_H__
+#define __SPDIF_COMPAT_LINUX_STRING_H__
+
+#include <string.h>
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * Userspace replacement for <linux/types.h>, used to build the encoder
+ * outside of the kernel.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __SPDIF_COMPAT_LINUX_TYPES_H__
+#define __SPDIF_COMPAT_LINUX_TYPES_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((__always_inline__))
+#endif
+
+#endif
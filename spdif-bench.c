@@ -0,0 +1,236 @@
+/*
+ * SPDIF encoder benchmark (userspace)
+ *
+ * Userspace build of the encoders. For every encoder implementation
+ * (or the ones named on the command line) and every input format the
+ * driver supports, plus the silence encoder, reports the time per frame,
+ * the throughput and the real-time factor at each supported sample rate,
+ * encoding whole 192-frame blocks. Each encoder first runs the self-test
+ * with many rounds of random input, and before timing a format its output
+ * is compared against the per-frame encoder and decoded again. The
+ * decoder speed is reported last.
+ *
+ * Build and run with "make bench" for the configured SPDIF_TABLE_BITS, or
+ * "make bench-tables" for several sizes of the wide table.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "spdif-encoder.h"
+#include "spdif-decoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_FRAMES	SPDIF_BLOCKSIZE
+#define BENCH_MIN_NS	200000000ull	/* minimum run time per format */
+#define BENCH_SELFTEST_ROUNDS	2000	/* random input rounds per encoder */
+
+static struct spdif_encoder enc;
+static uint8_t pcm[BENCH_FRAMES * 8];
+static uint32_t encoded[BENCH_FRAMES * SPDIF_FRAMESIZE / sizeof(uint32_t)];
+
+static const struct {
+	const char *name;
+	enum spdif_format format;
+	uint32_t sample_mask;
+} formats[] = {
+	{ "S16_LE", SPDIF_FORMAT_S16_LE, SPDIF_SAMPLE_MASK },
+	{ "S20_LE", SPDIF_FORMAT_S24_LE, 0x0fffff00 },	/* as set up by the driver */
+	{ "S24_LE", SPDIF_FORMAT_S24_LE, SPDIF_SAMPLE_MASK },
+	{ "S24_3LE", SPDIF_FORMAT_S24_3LE, SPDIF_SAMPLE_MASK },
+	{ "S32_LE", SPDIF_FORMAT_S32_LE, SPDIF_SAMPLE_MASK },
+	{ "silence", SPDIF_FORMAT_NONE, SPDIF_SAMPLE_MASK },
+};
+
+/* sample rates supported by the driver */
+static const unsigned int rates[] = {
+	44100, 48000, 88200, 96000, 176400, 192000,
+};
+
+static uint32_t reference[BENCH_FRAMES * SPDIF_FRAMESIZE / sizeof(uint32_t)];
+static uint32_t decoded[BENCH_FRAMES * 2];
+static struct spdif_decoder dec;
+
+/* channel status as set up by the driver for 48 kHz, 16 bits */
+static const uint8_t channel_status[] = {
+	SPDIF_CS0_NOT_COPYRIGHT, SPDIF_CS1_DDCONV | SPDIF_CS1_ORIGINAL,
+	0, SPDIF_CS3_48000, SPDIF_CS4_WORDLEN_20_16,
+};
+
+static uint32_t load_sample(const uint8_t *p, enum spdif_format format)
+{
+	switch (format) {
+	case SPDIF_FORMAT_S16_LE:
+		return (uint32_t)(p[0] | p[1] << 8) << 12;
+	case SPDIF_FORMAT_S24_LE:
+		return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) << 4;
+	case SPDIF_FORMAT_S24_3LE:
+		return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16) << 4;
+	case SPDIF_FORMAT_S32_LE:
+		return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) >> 4;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Compares the block encoder against the per-frame encoder, and checks
+ * that the decoder recovers the samples and the channel status.
+ */
+static int check_format(enum spdif_format format)
+{
+	static const size_t sample_size[] = {
+		[SPDIF_FORMAT_S16_LE] = 2, [SPDIF_FORMAT_S24_LE] = 4,
+		[SPDIF_FORMAT_S24_3LE] = 3, [SPDIF_FORMAT_S32_LE] = 4,
+	};
+	static struct spdif_encoder ref;
+	size_t size = sample_size[format];
+	int i;
+
+	ref = enc;
+	for (i = 0; i < BENCH_FRAMES; i++)
+		spdif_encode_frame_generic(&ref, &reference[i * 4],
+			load_sample(&pcm[2 * i * size], format),
+			load_sample(&pcm[(2 * i + 1) * size], format));
+	spdif_encode_block(&enc, encoded, format ? pcm : NULL, BENCH_FRAMES, format);
+	if (memcmp(encoded, reference, sizeof(encoded)) != 0)
+		return 1;
+
+	spdif_decoder_init(&dec);
+	if (spdif_decode_block(&dec, decoded, encoded, BENCH_FRAMES) != BENCH_FRAMES ||
+	    !dec.channel_status_valid ||
+	    memcmp(dec.channel_status, enc.channel_status, SPDIF_CHSTATSIZE) != 0)
+		return 1;
+	for (i = 0; i < 2 * BENCH_FRAMES; i++) {
+		if ((decoded[i] ^ load_sample(&pcm[i * size], format)) &
+		    enc.sample_mask)
+			return 1;
+	}
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* returns the encoding time per frame in ns */
+static double bench_format(enum spdif_format format)
+{
+	uint64_t start, elapsed;
+	unsigned long blocks = 0;
+
+	start = now_ns();
+	do {
+		if (format == SPDIF_FORMAT_NONE)
+			spdif_encode_silence(&enc, encoded, BENCH_FRAMES);
+		else
+			spdif_encode_block(&enc, encoded, pcm, BENCH_FRAMES, format);
+		blocks++;
+		elapsed = now_ns() - start;
+	} while (elapsed < BENCH_MIN_NS);
+	return (double)elapsed / (blocks * BENCH_FRAMES);
+}
+
+/* returns the decoding time per frame in ns */
+static double bench_decoder(void)
+{
+	uint64_t start, elapsed;
+	unsigned long blocks = 0;
+
+	start = now_ns();
+	do {
+		spdif_decode_block(&dec, decoded, encoded, BENCH_FRAMES);
+		blocks++;
+		elapsed = now_ns() - start;
+	} while (elapsed < BENCH_MIN_NS);
+	return (double)elapsed / (blocks * BENCH_FRAMES);
+}
+
+static void print_result(const char *name, const char *format, double ns)
+{
+	size_t i;
+
+	printf("%-8s %-8s %8.2f %9.2f ", name, format, ns, 1e3 / ns);
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		printf(" %7.0f", 1e9 / rates[i] / ns);
+	printf("\n");
+}
+
+static int selected(const char *name, int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], name) == 0)
+			return 1;
+	}
+	return argc <= 1;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct spdif_encoder_impl *const *impl;
+	uint32_t seed = now_ns();
+	size_t i;
+	int ret;
+
+	srand(1);
+	for (i = 0; i < sizeof(pcm); i++)
+		pcm[i] = rand();
+	spdif_encoder_init(&enc);
+	spdif_encoder_set_channel_status(&enc, channel_status,
+					 sizeof(channel_status));
+
+#if SPDIF_TABLE_BITS > 8
+	printf("table bits %d, wide table size %zu bytes, %d lookups/subframe\n",
+	       SPDIF_TABLE_BITS, sizeof(uint32_t) << SPDIF_TABLE_BITS,
+	       (28 + SPDIF_TABLE_BITS - 1) / SPDIF_TABLE_BITS);
+#endif
+	printf("%-8s %-8s %8s %9s  real-time factor at\n",
+	       "encoder", "format", "ns/frame", "Mframes/s");
+	printf("%37s", "");
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		printf(" %7u", rates[i]);
+	printf("\n");
+
+	for (impl = spdif_encoder_impls; *impl; impl++) {
+		if ((*impl)->usable && !(*impl)->usable())
+			continue;
+		if (!selected((*impl)->name, argc, argv))
+			continue;
+		ret = spdif_encoder_selftest(*impl, BENCH_SELFTEST_ROUNDS, seed);
+		if (ret) {
+			printf("%s: self-test failed: %d (seed %u)\n",
+			       (*impl)->name, ret, seed);
+			return 1;
+		}
+		spdif_encoder_set_impl(&enc, *impl);
+		for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+			spdif_encoder_set_sample_mask(&enc, formats[i].sample_mask);
+			if (check_format(formats[i].format)) {
+				printf("%s %s: output differs from the per-frame encoder "
+				       "or does not decode\n",
+				       (*impl)->name, formats[i].name);
+				return 1;
+			}
+			print_result((*impl)->name, formats[i].name,
+				     bench_format(formats[i].format));
+		}
+	}
+	print_result("decoder", "", bench_decoder());
+	return 0;
+}
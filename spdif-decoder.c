@@ -0,0 +1,143 @@
+/*
+ * SPDIF decoder
+ *
+ * Copyright (C) 2024 Matti Metsälä
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "spdif-decoder.h"
+#include <linux/errno.h>
+#include <linux/string.h>
+
+/* clock and data cells of data bits 4..31 in the 64 cells of a subframe */
+#define SPDIF_CLOCK_CELLS	0x00aaaaaaaaaaaaaaull
+#define SPDIF_DATA_CELLS	0x0055555555555555ull
+
+/*
+ * Decodes one subframe without lookup tables, the inverse of the bit
+ * parallel encoder. Bit n of cells ^ (cells >> 1) is set where cell n
+ * differs from the cell before it. Each data bit must start with such a
+ * transition at its clock cell, and has a second one at its data cell if
+ * it is set. The data cell transitions are packed from every other bit
+ * and bit reversed into the subframe.
+ */
+int spdif_decode_subframe(const uint32_t *encoded, uint32_t *subframe)
+{
+	uint64_t cells = (uint64_t)encoded[0] << 32 | encoded[1];
+	uint64_t trans = cells ^ (cells >> 1);
+	uint32_t preamble, data, parity;
+
+	if ((trans & SPDIF_CLOCK_CELLS) != SPDIF_CLOCK_CELLS)
+		return -EILSEQ;
+
+	trans &= SPDIF_DATA_CELLS;
+	trans = (trans | (trans >>  1)) & 0x3333333333333333ull;
+	trans = (trans | (trans >>  2)) & 0x0f0f0f0f0f0f0f0full;
+	trans = (trans | (trans >>  4)) & 0x00ff00ff00ff00ffull;
+	trans = (trans | (trans >>  8)) & 0x0000ffff0000ffffull;
+	trans = (trans | (trans >> 16)) & 0x00000000ffffffffull;
+	data = spdif_bitrev32((uint32_t)trans);
+
+	/* the preamble starts with three cells at the opposite level */
+	preamble = cells >> 56;
+	if (!(preamble & 0x80))
+		preamble ^= 0xff;
+	switch (preamble) {
+	case 0xe2:
+		data |= SPDIF_PREAMBLE_X;
+		break;
+	case 0xe4:
+		data |= SPDIF_PREAMBLE_Y;
+		break;
+	case 0xe8:
+		data |= SPDIF_PREAMBLE_Z;
+		break;
+	default:
+		return -EILSEQ;
+	}
+	*subframe = data;
+
+	parity = data & ~SPDIF_PREAMBLE_MASK;
+	parity ^= parity >> 16;
+	parity ^= parity >> 8;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	return parity & 1 ? -EBADMSG : 0;
+}
+
+void spdif_decoder_init(struct spdif_decoder *dec)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->frame_ctr = -1;
+}
+
+/* checks the preambles of a frame and collects the channel status */
+static int spdif_decode_frame_sequence(struct spdif_decoder *dec,
+				       const uint32_t *subframes)
+{
+	int ctr = dec->frame_ctr;
+
+	if ((subframes[1] & SPDIF_PREAMBLE_MASK) != SPDIF_PREAMBLE_Y)
+		return -EPROTO;
+
+	switch (subframes[0] & SPDIF_PREAMBLE_MASK) {
+	case SPDIF_PREAMBLE_Z:
+		if (ctr >= 0 && ctr != SPDIF_BLOCKSIZE)
+			return -EPROTO;
+		ctr = 0;
+		memset(dec->cs_block, 0, SPDIF_CHSTATSIZE);
+		break;
+	case SPDIF_PREAMBLE_X:
+		if (ctr < 0)
+			return 0; /* not locked to the block yet */
+		if (ctr == SPDIF_BLOCKSIZE)
+			return -EPROTO;
+		break;
+	default:
+		return -EPROTO;
+	}
+
+	if (subframes[0] & SPDIF_C_MASK)
+		dec->cs_block[ctr / 8] |= 1 << (ctr % 8);
+	if (++ctr == SPDIF_BLOCKSIZE) {
+		memcpy(dec->channel_status, dec->cs_block, SPDIF_CHSTATSIZE);
+		dec->channel_status_valid = true;
+	}
+	dec->frame_ctr = ctr;
+	return 0;
+}
+
+unsigned int spdif_decode_block(struct spdif_decoder *dec, uint32_t *subframes,
+				const void *encoded, unsigned int nframes)
+{
+	const uint32_t *src = encoded;
+	unsigned int i;
+	int ret;
+
+	dec->error = 0;
+	for (i = 0; i < nframes; i++) {
+		ret = spdif_decode_subframe(src, &subframes[0]);
+		if (!ret)
+			ret = spdif_decode_subframe(src + 2, &subframes[1]);
+		if (!ret)
+			ret = spdif_decode_frame_sequence(dec, subframes);
+		if (ret) {
+			dec->error = ret;
+			dec->errors++;
+			dec->frame_ctr = -1;
+			break;
+		}
+		src += SPDIF_FRAMESIZE / sizeof(uint32_t);
+		subframes += 2;
+	}
+	return i;
+}
@@ -0,0 +1,62 @@
+/*
+ * SPDIF decoder
+ *
+ * Copyright (C) 2024 Matti Metsälä
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef __SPDIF_DECODER_H__
+#define __SPDIF_DECODER_H__
+
+#include "spdif-encoder.h"
+
+/*
+ * Decodes biphase mark coded frames in the format written by the encoder
+ * (SPDIF_FRAMESIZE bytes per frame, two 32-bit words per subframe, first
+ * cell in the most significant bit) back into subframes: preamble code in
+ * bits 0..3 (SPDIF_PREAMBLE_X/Y/Z), data in bits 4..31, i.e. the layout
+ * the encoder takes as input. Either line polarity is accepted.
+ *
+ * Errors:
+ *   -EILSEQ  biphase mark violation or unknown preamble
+ *   -EBADMSG parity error
+ *   -EPROTO  preamble out of sequence (block decoder only)
+ */
+int spdif_decode_subframe(const uint32_t *encoded, uint32_t *subframe);
+
+typedef struct spdif_decoder {
+	int frame_ctr;		/* frames of the block so far, -1 until a Z */
+	int error;		/* error that stopped spdif_decode_block() */
+	unsigned long errors;	/* number of frames with errors */
+
+	/* channel status of channel A, from the last complete block */
+	uint8_t channel_status[SPDIF_CHSTATSIZE];
+	bool channel_status_valid;
+	uint8_t cs_block[SPDIF_CHSTATSIZE];	/* block being received */
+} spdif_decoder_t;
+
+void spdif_decoder_init(struct spdif_decoder *dec);
+
+/*
+ * Decodes nframes frames into 2 * nframes subframes (left, right) and
+ * follows the block structure. Stops at the first invalid frame and
+ * stores its error in dec->error. Returns the number of frames decoded.
+ */
+unsigned int spdif_decode_block(struct spdif_decoder *dec, uint32_t *subframes,
+				const void *encoded, unsigned int nframes);
+
+/* 24-bit audio sample of a decoded subframe, sign extended */
+static inline int32_t spdif_subframe_sample(uint32_t subframe)
+{
+	return (int32_t)(subframe << 4) >> 8;
+}
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * SPDIF encoder, vector kernel
+ *
+ * Copyright (C) 2015, 2023 Stephan "Kiffie" <kiffie.vanhaash@gmail.com>
+ * 2024 Matti Metsälä
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Encodes four frames (eight subframes) per iteration with GCC vector
+ * extensions. The backend follows the compiler flags this file is built
+ * with: NEON on ARM, SSE on x86 (used to validate the kernel against the
+ * scalar encoder on a development host). In the kernel, this file is built
+ * with FPU flags and must only be called between kernel_neon_begin() and
+ * kernel_neon_end().
+ *
+ * Table lookups do not vectorize, so the biphase mark code is computed
+ * with bit operations in 32-bit lanes. The first word of an encoded
+ * subframe holds the preamble and data bits 4..15, the second word data
+ * bits 16..31. Data bit i is placed with its clock transition at cell
+ * 63 - 2 * i and its data transition at cell 62 - 2 * i of the subframe,
+ * i.e. the bit reversed subframe is spread to every other cell and the
+ * clock cells are set. A XOR scan from the first cell then converts the
+ * transitions into line levels.
+ */
+
+#include "spdif-encoder.h"
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v4u32_u __attribute__((vector_size(16), aligned(4)));
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef uint8_t v16u8_u __attribute__((vector_size(16), aligned(1)));
+
+#ifdef __clang__
+#define spdif_shuffle(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#define spdif_shuffle8(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define spdif_shuffle(a, b, ...) __builtin_shuffle(a, b, (v4u32){ __VA_ARGS__ })
+#define spdif_shuffle8(a, b, ...) __builtin_shuffle(a, b, (v16u8){ __VA_ARGS__ })
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+static __always_inline v4u32 spdif_bitrev(v4u32 x)
+{
+	return (v4u32)vrev32q_u8(vrbitq_u8((uint8x16_t)x));
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+/* ARMv7 has no vector bit reverse: nibble lookup with vtbl, then bytes */
+static __always_inline uint8x16_t spdif_nibble_rev(uint8x16_t v)
+{
+	const uint8x8x2_t nibble_rev = { {
+		vcreate_u8(0x0e060a020c040800ULL),
+		vcreate_u8(0x0f070b030d050901ULL),
+	} };
+
+	return vcombine_u8(vtbl2_u8(nibble_rev, vget_low_u8(v)),
+			   vtbl2_u8(nibble_rev, vget_high_u8(v)));
+}
+
+static __always_inline v4u32 spdif_bitrev(v4u32 x)
+{
+	uint8x16_t v = (uint8x16_t)x;
+
+	v = vorrq_u8(vshlq_n_u8(spdif_nibble_rev(vandq_u8(v, vdupq_n_u8(0x0f))), 4),
+		     spdif_nibble_rev(vshrq_n_u8(v, 4)));
+	return (v4u32)vrev32q_u8(v);
+}
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+
+static __always_inline v4u32 spdif_bitrev(v4u32 x)
+{
+	const __m128i nibble_rev = _mm_setr_epi8(0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+						 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf);
+	const __m128i byte_rev = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+					       11, 10, 9, 8, 15, 14, 13, 12);
+	const __m128i low = _mm_set1_epi8(0x0f);
+	__m128i v = (__m128i)x;
+
+	v = _mm_or_si128(
+		_mm_slli_epi16(_mm_shuffle_epi8(nibble_rev, _mm_and_si128(v, low)), 4),
+		_mm_shuffle_epi8(nibble_rev, _mm_and_si128(_mm_srli_epi16(v, 4), low)));
+	return (v4u32)_mm_shuffle_epi8(v, byte_rev);
+}
+#else
+static __always_inline v4u32 spdif_bitrev(v4u32 x)
+{
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+	return (x >> 16) | (x << 16);
+}
+#endif
+
+/* moves bit n of the low 16 bits to bit 2 * n */
+static __always_inline v4u32 spdif_spread(v4u32 x)
+{
+	x &= 0x0000ffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+/* bit n of the result: XOR of bits n..31, i.e. line level after cell 31 - n */
+static __always_inline v4u32 spdif_xor_scan(v4u32 x)
+{
+	x ^= x >> 1;
+	x ^= x >> 2;
+	x ^= x >> 4;
+	x ^= x >> 8;
+	x ^= x >> 16;
+	return x;
+}
+
+/* encodes four subframes into the first (hi) and second (lo) words */
+static __always_inline void spdif_encode_subframes(v4u32 subframe,
+						   v4u32 *hi, v4u32 *lo)
+{
+	v4u32 data, parity, code, rev;
+
+	/* set the parity bit to make each subframe even */
+	data = subframe & ~(uint32_t)SPDIF_PREAMBLE_MASK;
+	parity = data ^ (data >> 16);
+	parity ^= parity >> 8;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	data ^= parity << 31;
+
+	rev = spdif_bitrev(data);
+	*hi = spdif_xor_scan(spdif_spread(rev >> 16) | 0x00aaaaaa);
+	*lo = spdif_xor_scan(spdif_spread(rev) | 0xaaaaaaaa);
+	/* continue from the level at the end of the first word */
+	*lo ^= (v4u32){ 0, 0, 0, 0 } - (*hi & 1);
+
+	/* preamble X: 0xe2, Y: 0xe4, Z: 0xe8 for codes 0, 1, 2 */
+	code = subframe & SPDIF_PREAMBLE_MASK;
+	*hi |= (0xe2 + 2 * code + 2 * (code >> 1)) << 24;
+}
+
+void spdif_encode_frames_simd(void *encoded, const uint32_t *samples,
+			      const uint32_t *templates, uint32_t sample_mask,
+			      unsigned int nframes)
+{
+	v4u32_u *dst = encoded;
+	const v4u32_u *src = (const v4u32_u *)samples;
+	const v4u32_u *tmpl = (const v4u32_u *)templates;
+	v4u32 s0, s1, left, right;
+	v4u32 hl, ll, hr, lr, a, b, c, d;
+
+	for (; nframes >= 4; nframes -= 4) {
+		/* two vectors of interleaved left/right subframes */
+		s0 = (src[0] & sample_mask) | tmpl[0];
+		s1 = (src[1] & sample_mask) | tmpl[1];
+		src += 2;
+		tmpl += 2;
+		left = spdif_shuffle(s0, s1, 0, 2, 4, 6);
+		right = spdif_shuffle(s0, s1, 1, 3, 5, 7);
+
+		spdif_encode_subframes(left, &hl, &ll);
+		spdif_encode_subframes(right, &hr, &lr);
+
+		/* transpose to hl ll hr lr per frame */
+		a = spdif_shuffle(hl, ll, 0, 4, 1, 5);
+		b = spdif_shuffle(hl, ll, 2, 6, 3, 7);
+		c = spdif_shuffle(hr, lr, 0, 4, 1, 5);
+		d = spdif_shuffle(hr, lr, 2, 6, 3, 7);
+		dst[0] = spdif_shuffle(a, c, 0, 1, 4, 5);
+		dst[1] = spdif_shuffle(a, c, 2, 3, 6, 7);
+		dst[2] = spdif_shuffle(b, d, 0, 1, 4, 5);
+		dst[3] = spdif_shuffle(b, d, 2, 3, 6, 7);
+		dst += 4;
+	}
+}
+
+/*
+ * Unpack stage. Each step converts four PCM frames into two vectors of
+ * shifted samples. The 16-bit and packed 24-bit samples are widened with
+ * byte shuffles that take the zero bytes from the second operand (index
+ * 16), the packed 24-bit frames are read as two overlapping 16-byte loads.
+ */
+static __always_inline void spdif_unpack_s16le(v4u32 *dst, const uint8_t *src)
+{
+	v16u8 v = *(const v16u8_u *)src, z = { 0 };
+
+	dst[0] = (v4u32)spdif_shuffle8(v, z, 0, 1, 16, 16, 2, 3, 16, 16,
+				       4, 5, 16, 16, 6, 7, 16, 16) << 12;
+	dst[1] = (v4u32)spdif_shuffle8(v, z, 8, 9, 16, 16, 10, 11, 16, 16,
+				       12, 13, 16, 16, 14, 15, 16, 16) << 12;
+}
+
+static __always_inline void spdif_unpack_s24_3le(v4u32 *dst, const uint8_t *src)
+{
+	v16u8 v0 = *(const v16u8_u *)src, v1 = *(const v16u8_u *)(src + 8);
+	v16u8 z = { 0 };
+
+	dst[0] = (v4u32)spdif_shuffle8(v0, z, 0, 1, 2, 16, 3, 4, 5, 16,
+				       6, 7, 8, 16, 9, 10, 11, 16) << 4;
+	dst[1] = (v4u32)spdif_shuffle8(v1, z, 4, 5, 6, 16, 7, 8, 9, 16,
+				       10, 11, 12, 16, 13, 14, 15, 16) << 4;
+}
+
+void spdif_unpack_frames_simd(uint32_t *samples, const void *pcm,
+			      unsigned int nframes, enum spdif_format format)
+{
+	v4u32 *dst = (v4u32 *)samples;
+	const uint8_t *src = pcm;
+	unsigned int i;
+
+	switch (format) {
+	case SPDIF_FORMAT_S16_LE:
+		for (i = 0; i < nframes; i += 4, src += 16, dst += 2)
+			spdif_unpack_s16le(dst, src);
+		break;
+	case SPDIF_FORMAT_S24_LE:
+		for (i = 0; i < nframes; i += 4, src += 32, dst += 2) {
+			dst[0] = ((const v4u32_u *)src)[0] << 4;
+			dst[1] = ((const v4u32_u *)src)[1] << 4;
+		}
+		break;
+	case SPDIF_FORMAT_S24_3LE:
+		for (i = 0; i < nframes; i += 4, src += 24, dst += 2)
+			spdif_unpack_s24_3le(dst, src);
+		break;
+	case SPDIF_FORMAT_S32_LE:
+		for (i = 0; i < nframes; i += 4, src += 32, dst += 2) {
+			dst[0] = ((const v4u32_u *)src)[0] >> 4;
+			dst[1] = ((const v4u32_u *)src)[1] >> 4;
+		}
+		break;
+	default:
+		for (i = 0; i < nframes; i += 4, dst += 2) {
+			dst[0] = (v4u32){ 0, 0, 0, 0 };
+			dst[1] = (v4u32){ 0, 0, 0, 0 };
+		}
+		break;
+	}
+}
@@ -17,145 +17,591 @@
 #include "spdif-encoder.h"
 #include <linux/string.h>
 
-static uint16_t spdif_biphase_encode(bool last, uint8_t data){
-	int i;
-	uint16_t result=0;
-
-	for( i=0; i< 8; i++){
-		result<<=2;
-		if( data&1 ){
-			result|= 0b10;
-		}else{
-			result|= 0b11;
-		}
-		if( last ){
-			result^= 0b11;
-		}
-		last= result&1;
-		data>>=1;
+/* build with -DSPDIF_ENCODER_DEBUG to check encoder invariants */
+#ifdef SPDIF_ENCODER_DEBUG
+#include <linux/bug.h>
+#define spdif_assert(cond) WARN_ON_ONCE(!(cond))
+#else
+#define spdif_assert(cond) do { } while (0)
+#endif
+
+/*
+ * Encodes one subframe. The subframe is a frame template (preamble, C bit
+ * and the parity of both) combined with the masked audio sample.
+ *
+ * Every subframe has even parity, so it ends at the polarity it started
+ * with and all subframes can be encoded against a line level of 0. Within
+ * the subframe, the polarity at the start of a byte is the parity of all
+ * data bits before it, so the byte encodings do not depend on each other.
+ */
+static __always_inline void spdif_encode_subframe_byte(uint32_t *encoded,
+						       uint32_t subframe)
+{
+	uint32_t parity, inv;
+	uint32_t data;
+
+	/* parity of each byte in bit 0 of the byte, preamble excluded */
+	parity = subframe & ~SPDIF_PREAMBLE_MASK;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	parity &= 0x01010101;
+	/* bit 0 of bytes 1..3: parity of all preceding bytes */
+	inv = parity * 0x01010100;
+	/* set the parity bit (bit 7 of byte 3) to make the subframe even */
+	subframe ^= ((inv ^ parity) << 7) & SPDIF_P_MASK;
+
+	data = (uint32_t)spdif_first_byte[subframe & 0xff] << 16 |
+		spdif_byte[(subframe >> 8) & 0xff];
+	encoded[0] = data ^ ((0 - ((inv >> 8) & 1)) & 0x0000ffff);
+
+	data = (uint32_t)spdif_byte[(subframe >> 16) & 0xff] << 16 |
+		spdif_byte[subframe >> 24];
+	encoded[1] = data ^ ((0 - ((inv >> 16) & 1)) & 0xffff0000)
+			  ^ ((0 - ((inv >> 24) & 1)) & 0x0000ffff);
+
+	spdif_assert(!(encoded[1] & 1));
+}
+
+/*
+ * Byte kernel for samples of 20 bits or less. The auxiliary bits 4..7 are
+ * zero, so byte 0 holds only the preamble: its encoding is a constant per
+ * preamble and byte 1 starts at level 0. With 16-bit samples bits 8..11
+ * are zero as well, and the whole first word is one of the precomputed
+ * words in spdif_first_word16, indexed by the preamble and bits 12..15.
+ */
+static __always_inline void spdif_encode_subframe_narrow(uint32_t *encoded,
+							 uint32_t subframe,
+							 const int bits)
+{
+	uint32_t code = subframe & SPDIF_PREAMBLE_MASK;
+	uint32_t parity, inv;
+	uint32_t data;
+
+	/* parity of bytes 1..3 in bit 0 of the byte */
+	parity = subframe & 0xffffff00;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	parity &= 0x01010100;
+	inv = parity * 0x01010100;
+	subframe ^= ((inv ^ parity) << 7) & SPDIF_P_MASK;
+
+	if (bits == 16)
+		encoded[0] = spdif_first_word16[code << 4 | ((subframe >> 12) & 0xf)];
+	else
+		encoded[0] = (0xe0 | 2 << code) << 24 | 0xcc << 16 |
+			spdif_byte[(subframe >> 8) & 0xff];
+
+	data = (uint32_t)spdif_byte[(subframe >> 16) & 0xff] << 16 |
+		spdif_byte[subframe >> 24];
+	encoded[1] = data ^ ((0 - ((inv >> 16) & 1)) & 0xffff0000)
+			  ^ ((0 - ((inv >> 24) & 1)) & 0x0000ffff);
+
+	spdif_assert(!(encoded[1] & 1));
+}
+
+#if SPDIF_TABLE_BITS > 8
+/*
+ * Encodes the chunk of the subframe that starts at data bit pos and places
+ * it in the 64-bit subframe encoding. The last chunk may be narrower than
+ * SPDIF_TABLE_BITS, in which case only the top of the table entry is used.
+ * Each data bit starts with a transition and has a second one if it is
+ * set, so the polarity at the start of the chunk is the parity of the
+ * number of data bits before it plus the parity of their values.
+ */
+static __always_inline uint64_t spdif_encode_chunk_wide(uint32_t data,
+							uint32_t prefix,
+							const int pos)
+{
+	const int width = 32 - pos < SPDIF_TABLE_BITS ? 32 - pos : SPDIF_TABLE_BITS;
+	uint32_t entry;
+
+	if (pos >= 32)
+		return 0;
+	entry = spdif_wide_table[(data >> pos) & ((1u << width) - 1)];
+	entry >>= 2 * (SPDIF_TABLE_BITS - width);
+	entry ^= (0 - (((prefix >> (pos - 1)) ^ (pos - 4)) & 1)) &
+		 (uint32_t)((1ull << (2 * width)) - 1);
+	return (uint64_t)entry << (64 - 2 * (pos + width));
+}
+
+/*
+ * Encodes one subframe with SPDIF_TABLE_BITS data bits per table lookup.
+ * The preamble is computed (X: 0xe2, Y: 0xe4, Z: 0xe8) and the data bits
+ * 4..31 are encoded in up to four chunks from spdif_wide_table.
+ */
+static __always_inline void spdif_encode_subframe_wide(uint32_t *encoded,
+						       uint32_t subframe)
+{
+	uint32_t data, prefix;
+	uint64_t out;
+
+	data = subframe & ~SPDIF_PREAMBLE_MASK;
+	/* bit n of prefix: parity of data bits 4..n */
+	prefix = data ^ (data << 1);
+	prefix ^= prefix << 2;
+	prefix ^= prefix << 4;
+	prefix ^= prefix << 8;
+	prefix ^= prefix << 16;
+	/* set the parity bit to make the subframe even */
+	data ^= prefix & SPDIF_P_MASK;
+
+	out = (uint64_t)(0xe0 | (2 << (subframe & SPDIF_PREAMBLE_MASK))) << 56;
+	out |= spdif_encode_chunk_wide(data, prefix, 4);
+	out |= spdif_encode_chunk_wide(data, prefix, 4 + SPDIF_TABLE_BITS);
+	out |= spdif_encode_chunk_wide(data, prefix, 4 + 2 * SPDIF_TABLE_BITS);
+	out |= spdif_encode_chunk_wide(data, prefix, 4 + 3 * SPDIF_TABLE_BITS);
+	encoded[0] = out >> 32;
+	encoded[1] = (uint32_t)out;
+
+	spdif_assert(!(encoded[1] & 1));
+}
+#endif
+
+/*
+ * Encodes one subframe without lookup tables. Biphase mark coding puts a
+ * transition at the start of every data bit and a second one in the middle
+ * of a set bit. Data bit i has its clock cell at bit 63 - 2 * i and its
+ * data cell at bit 62 - 2 * i of the encoded subframe, so the transitions
+ * are the bit reversed subframe spread to the even bits, plus the clock
+ * bits. A XOR scan from the first cell converts transitions into levels.
+ */
+static __always_inline void spdif_encode_subframe_bitpar(uint32_t *encoded,
+							 uint32_t subframe)
+{
+	uint32_t data, parity;
+	uint64_t cells;
+
+	/* set the parity bit to make the subframe even */
+	data = subframe & ~SPDIF_PREAMBLE_MASK;
+	parity = data ^ (data >> 16);
+	parity ^= parity >> 8;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	data ^= parity << 31;
+
+	cells = spdif_bitrev32(data);
+	cells = (cells | (cells << 16)) & 0x0000ffff0000ffffull;
+	cells = (cells | (cells <<  8)) & 0x00ff00ff00ff00ffull;
+	cells = (cells | (cells <<  4)) & 0x0f0f0f0f0f0f0f0full;
+	cells = (cells | (cells <<  2)) & 0x3333333333333333ull;
+	cells = (cells | (cells <<  1)) & 0x5555555555555555ull;
+	cells |= 0x00aaaaaaaaaaaaaaull;
+
+	cells ^= cells >> 1;
+	cells ^= cells >> 2;
+	cells ^= cells >> 4;
+	cells ^= cells >> 8;
+	cells ^= cells >> 16;
+	cells ^= cells >> 32;
+
+	/* preamble X: 0xe2, Y: 0xe4, Z: 0xe8, ending at level 0 */
+	cells |= (uint64_t)(0xe0 | (2 << (subframe & SPDIF_PREAMBLE_MASK))) << 56;
+	encoded[0] = cells >> 32;
+	encoded[1] = (uint32_t)cells;
+
+	spdif_assert(!(encoded[1] & 1));
+}
+
+/* subframe kernels of the block encoders */
+#define SPDIF_KERNEL_BYTE	0
+#define SPDIF_KERNEL_WIDE	1
+#define SPDIF_KERNEL_BITPAR	2
+#define SPDIF_KERNEL_BYTE16	3	/* bits 4..11 of the subframe are zero */
+#define SPDIF_KERNEL_BYTE20	4	/* bits 4..7 of the subframe are zero */
+
+static __always_inline void spdif_encode_subframe(uint32_t *encoded,
+						  uint32_t subframe,
+						  const int kernel)
+{
+	switch (kernel) {
+#if SPDIF_TABLE_BITS > 8
+	case SPDIF_KERNEL_WIDE:
+		spdif_encode_subframe_wide(encoded, subframe);
+		break;
+#endif
+	case SPDIF_KERNEL_BITPAR:
+		spdif_encode_subframe_bitpar(encoded, subframe);
+		break;
+	case SPDIF_KERNEL_BYTE16:
+		spdif_encode_subframe_narrow(encoded, subframe, 16);
+		break;
+	case SPDIF_KERNEL_BYTE20:
+		spdif_encode_subframe_narrow(encoded, subframe, 20);
+		break;
+	default:
+		spdif_encode_subframe_byte(encoded, subframe);
+		break;
 	}
-	return result;
 }
 
-static uint16_t spdif_preamble_encode(bool last, uint8_t data){
+void spdif_encode_frame_generic(struct spdif_encoder *spdif,
+				void *encoded,
+				uint32_t left_shifted, uint32_t right_shifted)
+{
+	const uint32_t *template = spdif->frame_template[spdif->frame_ctr];
 
-	uint16_t result=0;
-	int i;
-	switch( data & SPDIF_PREAMBLE_MASK ){
-		case SPDIF_PREAMBLE_X:
-			result= 0b11100010;
-			break;
-		case SPDIF_PREAMBLE_Y:
-			result= 0b11100100;
-			break;
-		case SPDIF_PREAMBLE_Z:
-			result= 0b11101000;
-			break;
-		}
-	if( last ){
-		result^= 0xff;
+	spdif_encode_subframe(encoded,
+		template[0] | (left_shifted & spdif->sample_mask),
+		SPDIF_KERNEL_BYTE);
+	spdif_encode_subframe((uint32_t *)encoded + 2,
+		template[1] | (right_shifted & spdif->sample_mask),
+		SPDIF_KERNEL_BYTE);
+	if( ++spdif->frame_ctr >= SPDIF_BLOCKSIZE ){
+		spdif->frame_ctr= 0;
 	}
-	last= result&1;
-	data>>=4;
-	for(i=0; i<4; i++){
-		result<<=2;
-		if( data&1 ){
-			result|= 0b10;
-		}else{
-			result|= 0b11;
-		}
-		if( last ){
-			result^= 0b11;
-		}
-		last= result&1;
-		data>>=1;
+}
+
+/* pseudo format used to share the block loop with the silence encoder */
+#define SPDIF_FORMAT_SILENCE	(-1)
+
+/* unaligned little-endian 32-bit load, for the packed 24-bit format */
+static __always_inline uint32_t spdif_load_le32(const void *p)
+{
+	const struct { uint32_t v; } __attribute__((packed)) *u = p;
+
+	return u->v;
+}
+
+/*
+ * Loads one PCM frame and returns the samples shifted to the position of
+ * the audio sample in the subframe. Returns the size of the PCM frame.
+ */
+static __always_inline size_t spdif_load_frame(const void *frame, const int format,
+					       uint32_t *left, uint32_t *right)
+{
+	const uint8_t *p = frame;
+	const uint16_t *p16 = frame;
+	const uint32_t *p32 = frame;
+
+	switch (format) {
+	case SPDIF_FORMAT_S16_LE:
+		*left = (uint32_t)p16[0] << 12;
+		*right = (uint32_t)p16[1] << 12;
+		return 2 * sizeof(uint16_t);
+	case SPDIF_FORMAT_S24_LE:
+		*left = p32[0] << 4;
+		*right = p32[1] << 4;
+		return 2 * sizeof(uint32_t);
+	case SPDIF_FORMAT_S24_3LE:
+		/* two overlapping word loads instead of six byte loads */
+		*left = spdif_load_le32(p) << 8 >> 4;
+		*right = spdif_load_le32(p + 2) >> 8 << 4;
+		return 6;
+	case SPDIF_FORMAT_S32_LE:
+		*left = p32[0] >> 4;
+		*right = p32[1] >> 4;
+		return 2 * sizeof(uint32_t);
+	default:
+		*left = 0;
+		*right = 0;
+		return 0;
 	}
-	return result;
 }
 
-void spdif_fast_encode(struct spdif_encoder *spdif,
-		       void *encoded_buf, uint32_t subframe)
+/*
+ * Block encoder loop. It is instantiated once per input format and subframe
+ * kernel so that both are resolved at compile time. The encoder state lives
+ * in local variables for the whole block and is written back at the end.
+ */
+static __always_inline void spdif_encode_block_tmpl(struct spdif_encoder *spdif,
+						    uint32_t *encoded,
+						    const uint8_t *pcm,
+						    unsigned int nframes,
+						    const int format,
+						    const int kernel)
 {
-	uint32_t parity;
-	uint32_t *encoded = (uint32_t *)encoded_buf;
-	bool last;
-	uint32_t data0, data1;
+	unsigned int frame_ctr = spdif->frame_ctr;
+	uint32_t sample_mask = spdif->sample_mask;
+	uint32_t left, right;
 
-	/* add channel status bit */
-	if((spdif->channel_status[spdif->frame_ctr / 8] >> (spdif->frame_ctr % 8)) & 0x01)
-	{
-		subframe |= SPDIF_C_MASK;
+	while (nframes--) {
+		const uint32_t *template = spdif->frame_template[frame_ctr];
+
+		pcm += spdif_load_frame(pcm, format, &left, &right);
+		spdif_encode_subframe(encoded,
+			template[0] | (left & sample_mask), kernel);
+		spdif_encode_subframe(encoded + 2,
+			template[1] | (right & sample_mask), kernel);
+		encoded += SPDIF_FRAMESIZE / sizeof(uint32_t);
+		if (++frame_ctr >= SPDIF_BLOCKSIZE)
+			frame_ctr = 0;
 	}
-	parity = subframe & ~SPDIF_PREAMBLE_MASK; /* exclude preamble bits */
-	parity ^= parity >> 16; /* slightly faster than calling __builtin_parity() */
-	parity ^= parity >>  8;
-	parity ^= parity >>  4;
-	parity &= 0xf;
-	parity =  0x69960000 << parity;
-	parity &= 0x80000000;
-	subframe |= parity;
-	last = spdif->last;
-
-	data1 = spdif->first_byte[subframe & 0xff];
-	if(last){
-		data1^= 0xffff;
+	spdif->frame_ctr = frame_ctr;
+}
+
+#ifdef SPDIF_SIMD
+/* frames unpacked per call of the vector kernel */
+#define SPDIF_SIMD_FRAMES	32
+
+/*
+ * Block encoder loop for the vector kernel. The PCM input is unpacked with
+ * vector loads and shuffles into a small buffer of shifted samples, which
+ * the kernel combines with the frame templates four frames at a time.
+ * Runs of less than four frames before the end of the block or of the
+ * input are encoded one by one.
+ */
+static __always_inline void spdif_encode_block_simd(struct spdif_encoder *spdif,
+						    uint32_t *encoded,
+						    const uint8_t *pcm,
+						    unsigned int nframes,
+						    const int format)
+{
+	uint32_t samples[2 * SPDIF_SIMD_FRAMES] __attribute__((aligned(16)));
+	unsigned int frame_ctr, n;
+
+	while (nframes) {
+		frame_ctr = spdif->frame_ctr;
+		n = SPDIF_BLOCKSIZE - frame_ctr;
+		if (n > nframes)
+			n = nframes;
+		if (n > SPDIF_SIMD_FRAMES)
+			n = SPDIF_SIMD_FRAMES;
+		n &= ~3u;
+		if (n == 0) {
+			pcm += spdif_load_frame(pcm, format, &samples[0], &samples[1]);
+			spdif_encode_frame_generic(spdif, encoded, samples[0], samples[1]);
+			n = 1;
+		} else {
+			spdif_unpack_frames_simd(samples, pcm, n,
+				format == SPDIF_FORMAT_SILENCE ? SPDIF_FORMAT_NONE : format);
+			pcm += n * spdif_pcm_frame_size(format);
+			spdif_encode_frames_simd(encoded, samples,
+						 spdif->frame_template[frame_ctr],
+						 spdif->sample_mask, n);
+			frame_ctr += n;
+			spdif->frame_ctr = frame_ctr < SPDIF_BLOCKSIZE ? frame_ctr : 0;
+		}
+		encoded += n * (SPDIF_FRAMESIZE / sizeof(uint32_t));
+		nframes -= n;
 	}
-	last = data1&1;
+}
+
+#ifdef __KERNEL__
+#include <asm/neon.h>
+#include <asm/simd.h>
+
+static bool spdif_simd_usable(void)
+{
+#ifdef CONFIG_ARM
+	return cpu_has_neon();
+#else
+	return true;
+#endif
+}
+
+static bool spdif_simd_begin(void)
+{
+	if (!may_use_simd())
+		return false;
+	kernel_neon_begin();
+	return true;
+}
 
-	data0 = spdif->byte[(subframe >> 8) & 0xff];
-	if(last){
-		data0^= 0xffff;
+static void spdif_simd_end(void)
+{
+	kernel_neon_end();
+}
+#else
+static bool spdif_simd_usable(void)
+{
+	return true;
+}
+
+static bool spdif_simd_begin(void)
+{
+	return true;
+}
+
+static void spdif_simd_end(void)
+{
+}
+#endif
+#endif /* SPDIF_SIMD */
+
+/* instantiates the block loop of a kernel for every input format */
+#define SPDIF_FOR_EACH_FORMAT(loop, spdif, encoded, pcm, nframes, format, ...)	\
+	switch (format) {							\
+	case SPDIF_FORMAT_S16_LE:						\
+		loop(spdif, encoded, pcm, nframes, SPDIF_FORMAT_S16_LE, ##__VA_ARGS__); \
+		break;								\
+	case SPDIF_FORMAT_S24_LE:						\
+		loop(spdif, encoded, pcm, nframes, SPDIF_FORMAT_S24_LE, ##__VA_ARGS__); \
+		break;								\
+	case SPDIF_FORMAT_S24_3LE:						\
+		loop(spdif, encoded, pcm, nframes, SPDIF_FORMAT_S24_3LE, ##__VA_ARGS__); \
+		break;								\
+	case SPDIF_FORMAT_S32_LE:						\
+		loop(spdif, encoded, pcm, nframes, SPDIF_FORMAT_S32_LE, ##__VA_ARGS__); \
+		break;								\
+	default:								\
+		loop(spdif, encoded, pcm, nframes, SPDIF_FORMAT_SILENCE, ##__VA_ARGS__); \
+		break;								\
 	}
-	last= data0&1;
-        encoded[0] = data1 << 16 | data0;
 
-	data1 = spdif->byte[(subframe >> 16) & 0xff];
-	if(last){
-		data1^= 0xffff;
+/* per-frame encoder, as used before the block encoders */
+static void spdif_encode_block_frame(struct spdif_encoder *spdif, void *encoded,
+				     const void *pcm, unsigned int nframes,
+				     enum spdif_format format)
+{
+	const uint8_t *src = pcm;
+	uint8_t *dst = encoded;
+	uint32_t left, right;
+
+	while (nframes--) {
+		src += spdif_load_frame(src, format, &left, &right);
+		spdif_encode_frame_generic(spdif, dst, left, right);
+		dst += SPDIF_FRAMESIZE;
 	}
-	last = data1&1;
+}
+
+#define SPDIF_DEFINE_BLOCK_ENCODER(name, kernel)				\
+static void spdif_encode_block_##name(struct spdif_encoder *spdif,		\
+				      void *encoded, const void *pcm,		\
+				      unsigned int nframes,			\
+				      enum spdif_format format)			\
+{										\
+	SPDIF_FOR_EACH_FORMAT(spdif_encode_block_tmpl, spdif, encoded, pcm,	\
+			      nframes, format, kernel);				\
+}
+
+SPDIF_DEFINE_BLOCK_ENCODER(byte24, SPDIF_KERNEL_BYTE)
+SPDIF_DEFINE_BLOCK_ENCODER(byte20, SPDIF_KERNEL_BYTE20)
+SPDIF_DEFINE_BLOCK_ENCODER(byte16, SPDIF_KERNEL_BYTE16)
+#if SPDIF_TABLE_BITS > 8
+SPDIF_DEFINE_BLOCK_ENCODER(wide, SPDIF_KERNEL_WIDE)
+#endif
+SPDIF_DEFINE_BLOCK_ENCODER(bitpar, SPDIF_KERNEL_BITPAR)
+
+/* the byte kernel skips the bytes that cannot carry audio */
+static void spdif_encode_block_byte(struct spdif_encoder *spdif, void *encoded,
+				    const void *pcm, unsigned int nframes,
+				    enum spdif_format format)
+{
+	uint32_t sample_mask = spdif->sample_mask;
+
+	if (format == SPDIF_FORMAT_S16_LE || format == SPDIF_FORMAT_NONE ||
+	    !(sample_mask & 0x00000ff0))
+		spdif_encode_block_byte16(spdif, encoded, pcm, nframes, format);
+	else if (!(sample_mask & 0x000000f0))
+		spdif_encode_block_byte20(spdif, encoded, pcm, nframes, format);
+	else
+		spdif_encode_block_byte24(spdif, encoded, pcm, nframes, format);
+}
 
-	data0 = spdif->byte[(subframe >> 24) & 0xff];
-	if(last){
-		data0^= 0xffff;
+#ifdef SPDIF_SIMD
+static void spdif_encode_block_vector(struct spdif_encoder *spdif, void *encoded,
+				      const void *pcm, unsigned int nframes,
+				      enum spdif_format format)
+{
+	if (!spdif_simd_begin()) {
+		spdif_encode_block_byte(spdif, encoded, pcm, nframes, format);
+		return;
 	}
-	spdif->last= data0&1;
-	encoded[1] = data1 << 16 | data0;
+	SPDIF_FOR_EACH_FORMAT(spdif_encode_block_simd, spdif, encoded, pcm,
+			      nframes, format);
+	spdif_simd_end();
 }
+#endif
 
+static const struct spdif_encoder_impl spdif_impl_frame = {
+	.name = "frame",
+	.encode_block = spdif_encode_block_frame,
+};
 
-void spdif_encode_frame_generic(struct spdif_encoder *spdif,
-				void *encoded,
-				uint32_t left_shifted, uint32_t right_shifted)
+static const struct spdif_encoder_impl spdif_impl_block = {
+	.name = "block",
+	.encode_block = spdif_encode_block_byte,
+};
+
+#if SPDIF_TABLE_BITS > 8
+static const struct spdif_encoder_impl spdif_impl_wide = {
+	.name = "wide",
+	.encode_block = spdif_encode_block_wide,
+};
+#endif
+
+static const struct spdif_encoder_impl spdif_impl_bitpar = {
+	.name = "bitpar",
+	.encode_block = spdif_encode_block_bitpar,
+};
+
+#ifdef SPDIF_SIMD
+static const struct spdif_encoder_impl spdif_impl_simd = {
+	.name = "simd",
+	.usable = spdif_simd_usable,
+	.encode_block = spdif_encode_block_vector,
+};
+#endif
+
+const struct spdif_encoder_impl *const spdif_encoder_impls[] = {
+	&spdif_impl_frame,
+	&spdif_impl_block,
+#if SPDIF_TABLE_BITS > 8
+	&spdif_impl_wide,
+#endif
+	&spdif_impl_bitpar,
+#ifdef SPDIF_SIMD
+	&spdif_impl_simd,
+#endif
+	NULL,
+};
+
+const struct spdif_encoder_impl *spdif_encoder_find_impl(const char *name)
 {
-	uint8_t *p = encoded;
-	uint32_t subframe;
-	subframe = spdif->frame_ctr == 0 ? SPDIF_PREAMBLE_Z : SPDIF_PREAMBLE_X;
-	subframe |= left_shifted & spdif->sample_mask;
-	spdif_fast_encode(spdif, p, subframe);
-	p += SPDIF_FRAMESIZE/2;
-	subframe = SPDIF_PREAMBLE_Y | (right_shifted & spdif->sample_mask);
-	spdif_fast_encode(spdif, p, subframe);
-	if( ++spdif->frame_ctr >= SPDIF_BLOCKSIZE ){
-		spdif->frame_ctr= 0;
+	const struct spdif_encoder_impl *const *impl;
+
+	for (impl = spdif_encoder_impls; *impl; impl++) {
+		if (strcmp((*impl)->name, name) == 0)
+			return *impl;
 	}
+	return NULL;
+}
+
+void spdif_encode_block(struct spdif_encoder *spdif, void *encoded,
+			const void *pcm, unsigned int nframes,
+			enum spdif_format format)
+{
+	spdif->impl->encode_block(spdif, encoded, pcm, nframes, format);
+}
+
+void spdif_encode_silence(struct spdif_encoder *spdif, void *encoded,
+			  unsigned int nframes)
+{
+	spdif->impl->encode_block(spdif, encoded, NULL, nframes,
+				  SPDIF_FORMAT_NONE);
 }
 
 void spdif_encoder_init(struct spdif_encoder *spdif){
-	int i;
-	for(i=0; i< 256; i++){
-		spdif->first_byte[i]= spdif_preamble_encode(0, i);
-		spdif->byte[i]= spdif_biphase_encode(0, i);
-	}
 	spdif_encoder_set_channel_status(spdif, NULL, 0);
 	spdif->sample_mask = SPDIF_SAMPLE_MASK;
+	spdif->frame_ctr = 0;
+	spdif->impl = &spdif_impl_block;
 }
 
 void spdif_encoder_set_channel_status(struct spdif_encoder *spdif,
 				      const void *cs, size_t len)
 {
+	uint32_t cp;
+	int i;
+
 	memset(spdif->channel_status, 0, SPDIF_CHSTATSIZE);
 	memcpy(spdif->channel_status, cs, len <= SPDIF_CHSTATSIZE ? len : SPDIF_CHSTATSIZE);
+
+	/*
+	 * The C bit is the only non-sample bit that may be set (U and V are
+	 * always zero), so the parity of the non-sample bits equals C.
+	 */
+	for (i = 0; i < SPDIF_BLOCKSIZE; i++) {
+		cp = 0;
+		if ((spdif->channel_status[i / 8] >> (i % 8)) & 0x01)
+			cp = SPDIF_C_MASK | SPDIF_P_MASK;
+		spdif->frame_template[i][0] = cp |
+			(i == 0 ? SPDIF_PREAMBLE_Z : SPDIF_PREAMBLE_X);
+		spdif->frame_template[i][1] = cp | SPDIF_PREAMBLE_Y;
+	}
 }
 
 void spdif_encoder_set_sample_mask(struct spdif_encoder *spdif, uint32_t mask)
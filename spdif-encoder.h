@@ -17,22 +17,56 @@
 #ifndef __SPDIF_ENCODER_H__
 #define __SPDIF_ENCODER_H__
 
+#include <linux/cache.h>
 #include <linux/types.h>
 
 #define SPDIF_FRAMESIZE 16  /* size of encoded SPDIF frame in bytes */
 #define SPDIF_BLOCKSIZE 192 /* number of frames per SPDIF block */
 #define SPDIF_CHSTATSIZE (SPDIF_BLOCKSIZE/8) /* size of channel status block */
 
-typedef struct spdif_encoder {
-	uint16_t first_byte[256];
-	uint16_t byte[256];
+/*
+ * Number of data bits encoded per lookup of the shared table of the "wide"
+ * encoder (build-time option, 9..16). The table has 4 << SPDIF_TABLE_BITS
+ * bytes and a subframe needs ceil(28 / SPDIF_TABLE_BITS) lookups, e.g.
+ * 12: 16 KB and 3 lookups, 14: 64 KB and 2 lookups, 16: 256 KB and 2
+ * lookups. 0 leaves the "wide" encoder out.
+ */
+#ifndef SPDIF_TABLE_BITS
+#define SPDIF_TABLE_BITS 12
+#endif
+#if SPDIF_TABLE_BITS != 0 && (SPDIF_TABLE_BITS < 9 || SPDIF_TABLE_BITS > 16)
+#error "SPDIF_TABLE_BITS must be 0 or in the range 9..16"
+#endif
 
-	bool last; /* value of last encoded bit */
+/*
+ * Biphase mark tables, generated at build time by spdif-mktables into
+ * spdif-tables.c and shared by all encoders.
+ */
+extern const uint16_t spdif_first_byte[256];	/* preamble and bits 4..7 */
+extern const uint16_t spdif_byte[256];
+/* first word of 16-bit subframes, by preamble code and bits 12..15 */
+extern const uint32_t spdif_first_word16[3 * 16];
+#if SPDIF_TABLE_BITS > 8
+extern const uint32_t spdif_wide_table[1 << SPDIF_TABLE_BITS];
+#endif
+
+struct spdif_encoder_impl;
 
+typedef struct spdif_encoder {
+	/* state used for every block, kept in one cache line */
+	const struct spdif_encoder_impl *impl;	/* used by spdif_encode_block() */
+	uint32_t sample_mask;
 	uint8_t frame_ctr;
+
+	/*
+	 * Preamble, C bit and parity of the non-sample bits for the left
+	 * and right subframe of each frame in the block. Built from
+	 * channel_status by spdif_encoder_set_channel_status().
+	 */
+	uint32_t frame_template[SPDIF_BLOCKSIZE][2] ____cacheline_aligned;
+
 	uint8_t channel_status[SPDIF_CHSTATSIZE];
-	uint32_t sample_mask;
-} spdif_encoder_t;
+} ____cacheline_aligned spdif_encoder_t;
 
 #define SPDIF_PREAMBLE_X	0x00   /* channel A (left) */
 #define SPDIF_PREAMBLE_Y	0x01   /* channel B (right) */
@@ -86,11 +120,132 @@ typedef struct spdif_encoder {
 #define SPDIF_CS4_WORDLEN_21_17     0x0c
 
 
+/* reverses the bit order, shared by the encoder and the decoder */
+static __always_inline uint32_t spdif_bitrev32(uint32_t x)
+{
+#if defined(__aarch64__)
+	asm ("rbit %w0, %w1" : "=r" (x) : "r" (x));
+#elif defined(__arm__) && defined(__ARM_ARCH_ISA_THUMB) && __ARM_ARCH_ISA_THUMB >= 2
+	asm ("rbit %0, %1" : "=r" (x) : "r" (x));
+#else
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = __builtin_bswap32(x);
+#endif
+	return x;
+}
+
 void spdif_encoder_init(struct spdif_encoder *spdif);
 void spdif_encoder_set_channel_status(struct spdif_encoder *spdif,
                                       const void *cs, size_t len);
 void spdif_encoder_set_sample_mask(struct spdif_encoder *spdif, uint32_t mask);
 
+/* PCM input formats of the block encoder */
+enum spdif_format {
+	SPDIF_FORMAT_NONE = 0,
+	SPDIF_FORMAT_S16_LE,
+	SPDIF_FORMAT_S24_LE,	/* also S20_LE */
+	SPDIF_FORMAT_S24_3LE,	/* also S20_3LE */
+	SPDIF_FORMAT_S32_LE,
+};
+
+/* size of one interleaved stereo PCM frame, 0 for SPDIF_FORMAT_NONE */
+static inline size_t spdif_pcm_frame_size(enum spdif_format format)
+{
+	switch (format) {
+	case SPDIF_FORMAT_S16_LE:
+		return 2 * sizeof(uint16_t);
+	case SPDIF_FORMAT_S24_3LE:
+		return 6;
+	case SPDIF_FORMAT_S24_LE:
+	case SPDIF_FORMAT_S32_LE:
+		return 2 * sizeof(uint32_t);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Encodes nframes interleaved stereo PCM frames into nframes * SPDIF_FRAMESIZE
+ * bytes. SPDIF_FORMAT_NONE encodes silence and does not read from pcm.
+ */
+void spdif_encode_block(struct spdif_encoder *spdif, void *encoded,
+			const void *pcm, unsigned int nframes,
+			enum spdif_format format);
+void spdif_encode_silence(struct spdif_encoder *spdif, void *encoded,
+			  unsigned int nframes);
+
+/*
+ * Block encoder implementations. All produce the same output; which one is
+ * fastest depends on the CPU and its caches, so the driver benchmarks them
+ * when it is loaded. usable is NULL if the implementation runs everywhere.
+ */
+struct spdif_encoder_impl {
+	const char *name;
+	bool (*usable)(void);
+	void (*encode_block)(struct spdif_encoder *spdif, void *encoded,
+			     const void *pcm, unsigned int nframes,
+			     enum spdif_format format);
+};
+
+/* NULL terminated, the reference per-frame encoder "frame" first */
+extern const struct spdif_encoder_impl *const spdif_encoder_impls[];
+
+const struct spdif_encoder_impl *spdif_encoder_find_impl(const char *name);
+
+/*
+ * Self-test of an implementation (spdif-selftest.c): golden frames, then
+ * the given number of rounds of random input, channel status and sample
+ * mask against the per-frame encoder and through the decoder. Returns 0,
+ * -EIO if the output is wrong or -ENOMEM.
+ */
+int spdif_encoder_selftest(const struct spdif_encoder_impl *impl,
+			   unsigned int iterations, uint32_t seed);
+
+/* golden cases of the self-test, also run one at a time by spdif-kunit.c */
+enum spdif_selftest_case {
+	SPDIF_SELFTEST_S16_LE,
+	SPDIF_SELFTEST_S24_LE,
+	SPDIF_SELFTEST_S24_3LE,
+	SPDIF_SELFTEST_S32_LE,
+	SPDIF_SELFTEST_BLOCK_START,	/* Z/X/Y preambles across a block */
+	SPDIF_SELFTEST_SAMPLE_MASK,	/* 20-bit sample mask */
+	SPDIF_SELFTEST_GOLDEN_CASES,
+};
+
+/* one golden case; a NULL impl checks the spdif_encode_frame_* wrappers */
+int spdif_encoder_selftest_golden(const struct spdif_encoder_impl *impl,
+				  enum spdif_selftest_case golden);
+/* the random rounds of spdif_encoder_selftest() only */
+int spdif_encoder_selftest_random(const struct spdif_encoder_impl *impl,
+				  unsigned int iterations, uint32_t seed);
+
+static inline void spdif_encoder_set_impl(struct spdif_encoder *spdif,
+					  const struct spdif_encoder_impl *impl)
+{
+	spdif->impl = impl;
+}
+
+#ifdef SPDIF_SIMD
+/*
+ * Vector kernel (spdif-encoder-simd.c) used by spdif_encode_block().
+ * Encodes nframes (a multiple of 4) frames from interleaved left/right
+ * samples, already shifted to the sample position, and the matching
+ * frame templates. The templates must not wrap around the block.
+ */
+void spdif_encode_frames_simd(void *encoded, const uint32_t *samples,
+			      const uint32_t *templates, uint32_t sample_mask,
+			      unsigned int nframes);
+/*
+ * Unpacks nframes (a multiple of 4) PCM frames into interleaved left/right
+ * samples shifted to the sample position, for spdif_encode_frames_simd().
+ * samples must be 16-byte aligned. SPDIF_FORMAT_NONE stores zeros.
+ */
+void spdif_unpack_frames_simd(uint32_t *samples, const void *pcm,
+			      unsigned int nframes, enum spdif_format format);
+#endif
+
 void spdif_encode_frame_generic(struct spdif_encoder *spdif,
 				void *encoded,
 				uint32_t left_shifted, uint32_t right_shifted);
@@ -0,0 +1,102 @@
+/*
+ * SPDIF encoder KUnit suite
+ *
+ * Copyright (C) 2024 Matti Metsälä
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Runs the encoder self-test (spdif-selftest.c) on every encoder usable
+ * on this CPU: each golden case on its own, also through the per-frame
+ * wrappers, then the random rounds with fixed seeds so that a failure can
+ * be repeated.
+ */
+
+#include <kunit/test.h>
+#include "spdif-encoder.h"
+
+#define SPDIF_KUNIT_ROUNDS	64
+
+static const uint32_t spdif_kunit_seeds[] = { 1, 0x5eed, 0xdeadbeef };
+
+static bool spdif_kunit_usable(struct kunit *test,
+			       const struct spdif_encoder_impl *impl)
+{
+	if (impl->usable && !impl->usable()) {
+		kunit_info(test, "%s: not usable, skipped\n", impl->name);
+		return false;
+	}
+	return true;
+}
+
+static void spdif_kunit_golden(struct kunit *test,
+			       enum spdif_selftest_case golden)
+{
+	const struct spdif_encoder_impl *const *impl;
+
+	KUNIT_EXPECT_EQ_MSG(test, spdif_encoder_selftest_golden(NULL, golden),
+			    0, "per-frame wrappers");
+	for (impl = spdif_encoder_impls; *impl; impl++) {
+		if (spdif_kunit_usable(test, *impl))
+			KUNIT_EXPECT_EQ_MSG(test,
+				spdif_encoder_selftest_golden(*impl, golden),
+				0, "encoder %s", (*impl)->name);
+	}
+}
+
+#define SPDIF_KUNIT_GOLDEN(name, golden)				\
+static void spdif_encoder_test_##name(struct kunit *test)		\
+{									\
+	spdif_kunit_golden(test, golden);				\
+}
+
+SPDIF_KUNIT_GOLDEN(golden_s16le, SPDIF_SELFTEST_S16_LE)
+SPDIF_KUNIT_GOLDEN(golden_s24le, SPDIF_SELFTEST_S24_LE)
+SPDIF_KUNIT_GOLDEN(golden_s24_3le, SPDIF_SELFTEST_S24_3LE)
+SPDIF_KUNIT_GOLDEN(golden_s32le, SPDIF_SELFTEST_S32_LE)
+SPDIF_KUNIT_GOLDEN(golden_block_start, SPDIF_SELFTEST_BLOCK_START)
+SPDIF_KUNIT_GOLDEN(golden_sample_mask, SPDIF_SELFTEST_SAMPLE_MASK)
+
+static void spdif_encoder_test_random(struct kunit *test)
+{
+	const struct spdif_encoder_impl *const *impl;
+	size_t i;
+
+	for (impl = spdif_encoder_impls; *impl; impl++) {
+		if (!spdif_kunit_usable(test, *impl))
+			continue;
+		for (i = 0; i < ARRAY_SIZE(spdif_kunit_seeds); i++)
+			KUNIT_EXPECT_EQ_MSG(test,
+				spdif_encoder_selftest_random(*impl,
+						SPDIF_KUNIT_ROUNDS,
+						spdif_kunit_seeds[i]),
+				0, "encoder %s, seed %u", (*impl)->name,
+				spdif_kunit_seeds[i]);
+	}
+}
+
+static struct kunit_case spdif_encoder_test_cases[] = {
+	KUNIT_CASE(spdif_encoder_test_golden_s16le),
+	KUNIT_CASE(spdif_encoder_test_golden_s24le),
+	KUNIT_CASE(spdif_encoder_test_golden_s24_3le),
+	KUNIT_CASE(spdif_encoder_test_golden_s32le),
+	KUNIT_CASE(spdif_encoder_test_golden_block_start),
+	KUNIT_CASE(spdif_encoder_test_golden_sample_mask),
+	KUNIT_CASE(spdif_encoder_test_random),
+	{}
+};
+
+static struct kunit_suite spdif_encoder_test_suite = {
+	.name = "spdif-encoder",
+	.test_cases = spdif_encoder_test_cases,
+};
+
+kunit_test_suite(spdif_encoder_test_suite);
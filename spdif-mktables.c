@@ -0,0 +1,119 @@
+/*
+ * SPDIF encoder table generator
+ *
+ * Copyright (C) 2015, 2023 Stephan "Kiffie" <kiffie.vanhaash@gmail.com>
+ * 2024 Matti Metsälä
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Runs on the build host and prints the biphase mark tables of the encoder
+ * as C source, in the manner of lib/raid6/mktables.c. The tables end up in
+ * .rodata and are shared by all encoder instances.
+ *
+ * Usage: spdif-mktables <table bits> > spdif-tables.c
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint32_t spdif_biphase_encode(bool last, uint32_t data, int bits){
+	int i;
+	uint32_t result=0;
+
+	for( i=0; i< bits; i++){
+		result<<=2;
+		if( data&1 ){
+			result|= 0b10;
+		}else{
+			result|= 0b11;
+		}
+		if( last ){
+			result^= 0b11;
+		}
+		last= result&1;
+		data>>=1;
+	}
+	return result;
+}
+
+static uint16_t spdif_preamble_encode(bool last, uint8_t data){
+
+	uint16_t result=0;
+	switch( data & 0x0f ){
+		case 0x00: /* X */
+			result= 0b11100010;
+			break;
+		case 0x01: /* Y */
+			result= 0b11100100;
+			break;
+		case 0x02: /* Z */
+			result= 0b11101000;
+			break;
+		}
+	if( last ){
+		result^= 0xff;
+	}
+	last= result&1;
+	return result << 8 | spdif_biphase_encode(last, data >> 4, 4);
+}
+
+int main(int argc, char *argv[])
+{
+	int bits, i;
+
+	if (argc != 2 || ((bits = atoi(argv[1])) != 0 && (bits < 9 || bits > 16))) {
+		fprintf(stderr, "usage: %s <table bits>\n", argv[0]);
+		return 1;
+	}
+
+	printf("/*\n"
+	       " * Generated by spdif-mktables, do not edit.\n"
+	       " */\n"
+	       "\n"
+	       "#include \"spdif-encoder.h\"\n"
+	       "\n"
+	       "#if SPDIF_TABLE_BITS != %d\n"
+	       "#error \"spdif-tables.c was generated for SPDIF_TABLE_BITS=%d\"\n"
+	       "#endif\n", bits, bits);
+
+	printf("\nconst uint16_t spdif_first_byte[256] __attribute__((aligned(64))) = {");
+	for (i = 0; i < 256; i++)
+		printf("%s0x%04x,", i % 8 ? " " : "\n\t",
+		       spdif_preamble_encode(0, i));
+	printf("\n};\n");
+
+	printf("\nconst uint16_t spdif_byte[256] __attribute__((aligned(64))) = {");
+	for (i = 0; i < 256; i++)
+		printf("%s0x%04x,", i % 8 ? " " : "\n\t",
+		       spdif_biphase_encode(0, i, 8));
+	printf("\n};\n");
+
+	/* first word of 16-bit subframes: preamble code, bits 12..15 */
+	printf("\nconst uint32_t spdif_first_word16[3 * 16] __attribute__((aligned(64))) = {");
+	for (i = 0; i < 3 * 16; i++)
+		printf("%s0x%08x,", i % 4 ? " " : "\n\t",
+		       (uint32_t)spdif_preamble_encode(0, i >> 4) << 16 |
+		       spdif_biphase_encode(0, (i & 0xf) << 4, 8));
+	printf("\n};\n");
+
+	if (bits > 8) {
+		printf("\nconst uint32_t spdif_wide_table[%d] __attribute__((aligned(64))) = {",
+		       1 << bits);
+		for (i = 0; i < (1 << bits); i++)
+			printf("%s0x%08x,", i % 4 ? " " : "\n\t",
+			       spdif_biphase_encode(0, i, bits));
+		printf("\n};\n");
+	}
+	return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * SPDIF encoder self-test
+ *
+ * Copyright (C) 2024 Matti Metsälä
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Checks an encoder implementation before it is used, like the crypto
+ * self-tests: against golden IEC 60958 frames built independently of the
+ * encoders, against the per-frame encoder and its spdif_encode_frame_*
+ * wrappers over random input, and through the decoder for the block
+ * structure (Z preamble every 192 frames, X/Y otherwise), the C bits, even
+ * parity and the sample mask.
+ */
+
+#include "spdif-decoder.h"
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define SPDIF_SELFTEST_FRAMES	(2 * SPDIF_BLOCKSIZE)
+
+/*
+ * Golden frames: four frames per case, with the expected 24-bit sample
+ * (slots 4..27) of every subframe written out by hand. The expected
+ * output is built bit by bit from IEC 60958 by spdif_selftest_bmc(), not
+ * by an encoder under test.
+ */
+struct spdif_selftest_golden {
+	enum spdif_format format;
+	uint32_t sample_mask;		/* 0: all 24 bits */
+	unsigned int start;		/* frame of the block of the first frame */
+	uint8_t c;			/* C bit of frame i in bit i */
+	uint8_t pcm[4 * 8];
+	uint32_t samples[4][2];
+};
+
+static const struct spdif_selftest_golden spdif_golden[] = {
+	[SPDIF_SELFTEST_S16_LE] = {
+		.format = SPDIF_FORMAT_S16_LE, .c = 0x05,
+		.pcm = {
+			0x00, 0x00, 0xff, 0x7f,  0x00, 0x80, 0x34, 0x12,
+			0xa5, 0xa5, 0x5a, 0x5a,  0xff, 0xff, 0x01, 0x00,
+		},
+		.samples = {
+			{ 0x000000, 0x7fff00 }, { 0x800000, 0x123400 },
+			{ 0xa5a500, 0x5a5a00 }, { 0xffff00, 0x000100 },
+		},
+	},
+	/* the top byte of the container is not part of the sample */
+	[SPDIF_SELFTEST_S24_LE] = {
+		.format = SPDIF_FORMAT_S24_LE, .c = 0x05,
+		.pcm = {
+			0x00, 0x00, 0x00, 0x00,  0xff, 0xff, 0x7f, 0x00,
+			0x00, 0x00, 0x80, 0xff,  0x56, 0x34, 0x12, 0x00,
+			0xa5, 0xa5, 0xa5, 0xff,  0x5a, 0x5a, 0x5a, 0x00,
+			0xff, 0xff, 0xff, 0xff,  0x01, 0x00, 0x00, 0x00,
+		},
+		.samples = {
+			{ 0x000000, 0x7fffff }, { 0x800000, 0x123456 },
+			{ 0xa5a5a5, 0x5a5a5a }, { 0xffffff, 0x000001 },
+		},
+	},
+	[SPDIF_SELFTEST_S24_3LE] = {
+		.format = SPDIF_FORMAT_S24_3LE, .c = 0x05,
+		.pcm = {
+			0x00, 0x00, 0x00,  0xff, 0xff, 0x7f,
+			0x00, 0x00, 0x80,  0x56, 0x34, 0x12,
+			0xa5, 0xa5, 0xa5,  0x5a, 0x5a, 0x5a,
+			0xff, 0xff, 0xff,  0x01, 0x00, 0x00,
+		},
+		.samples = {
+			{ 0x000000, 0x7fffff }, { 0x800000, 0x123456 },
+			{ 0xa5a5a5, 0x5a5a5a }, { 0xffffff, 0x000001 },
+		},
+	},
+	/* the low byte is below the 24 bits of the line */
+	[SPDIF_SELFTEST_S32_LE] = {
+		.format = SPDIF_FORMAT_S32_LE, .c = 0x05,
+		.pcm = {
+			0x00, 0x00, 0x00, 0x00,  0xff, 0xff, 0xff, 0x7f,
+			0x00, 0x00, 0x00, 0x80,  0x78, 0x56, 0x34, 0x12,
+			0xa5, 0xa5, 0xa5, 0xa5,  0x5a, 0x5a, 0x5a, 0x5a,
+			0xff, 0xff, 0xff, 0xff,  0x00, 0x01, 0x00, 0x00,
+		},
+		.samples = {
+			{ 0x000000, 0x7fffff }, { 0x800000, 0x123456 },
+			{ 0xa5a5a5, 0x5a5a5a }, { 0xffffff, 0x000001 },
+		},
+	},
+	/* frames 190, 191, 0 and 1: X, X, Z, X, with C set in 190 and 0 */
+	[SPDIF_SELFTEST_BLOCK_START] = {
+		.format = SPDIF_FORMAT_S16_LE, .start = 190, .c = 0x05,
+		.pcm = {
+			0x01, 0x00, 0xfe, 0xff,  0x00, 0x40, 0x00, 0xc0,
+			0x57, 0x13, 0x68, 0x24,  0x0f, 0x0f, 0xf0, 0xf0,
+		},
+		.samples = {
+			{ 0x000100, 0xfffe00 }, { 0x400000, 0xc00000 },
+			{ 0x135700, 0x246800 }, { 0x0f0f00, 0xf0f000 },
+		},
+	},
+	/* 20-bit output of 24-bit samples, as set up by the driver for S20 */
+	[SPDIF_SELFTEST_SAMPLE_MASK] = {
+		.format = SPDIF_FORMAT_S24_LE, .sample_mask = 0x0fffff00,
+		.c = 0x0a,
+		.pcm = {
+			0xff, 0xff, 0x7f, 0x00,  0x01, 0x00, 0x80, 0xff,
+			0x56, 0x34, 0x12, 0x00,  0xa9, 0xcb, 0xed, 0xff,
+			0x0f, 0x00, 0x00, 0x00,  0xf0, 0xff, 0xff, 0xff,
+			0xa5, 0xa5, 0xa5, 0xff,  0x5a, 0x5a, 0x5a, 0x00,
+		},
+		.samples = {
+			{ 0x7ffff0, 0x800000 }, { 0x123450, 0xedcba0 },
+			{ 0x000000, 0xfffff0 }, { 0xa5a5a0, 0x5a5a50 },
+		},
+	},
+};
+
+/* preambles B (Z), M (X) and W (Y) after a low line, first cell MSB */
+#define SPDIF_SELFTEST_PREAMBLE_Z	0xe8
+#define SPDIF_SELFTEST_PREAMBLE_X	0xe2
+#define SPDIF_SELFTEST_PREAMBLE_Y	0xe4
+
+struct spdif_selftest {
+	struct spdif_encoder enc;
+	struct spdif_encoder ref;
+	struct spdif_decoder dec;
+	uint32_t state;		/* xorshift32 state */
+	uint8_t cs[SPDIF_CHSTATSIZE];
+	uint8_t pcm[SPDIF_SELFTEST_FRAMES * 8];
+	uint32_t encoded[SPDIF_SELFTEST_FRAMES * 4];
+	uint32_t reference[SPDIF_SELFTEST_FRAMES * 4];
+	uint32_t decoded[SPDIF_SELFTEST_FRAMES * 2];
+};
+
+static uint32_t spdif_selftest_random(struct spdif_selftest *t)
+{
+	uint32_t x = t->state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return t->state = x;
+}
+
+/*
+ * Biphase mark code of one subframe, one time slot at a time: the
+ * preamble, which leaves the line low, then slots 4..31 with the sample
+ * LSB first in slots 4..27, V and U clear, the C bit and even parity in
+ * slot 31. Every slot starts with a transition and a one has a second
+ * transition in the middle. The 64 cells are stored first cell MSB, in
+ * two words.
+ */
+static void spdif_selftest_bmc(uint32_t *encoded, uint8_t preamble,
+			       uint32_t sample, bool c)
+{
+	uint32_t slots = (sample & 0xffffff) | (uint32_t)c << 26;
+	uint64_t cells = preamble;
+	bool level = false, parity = false;
+	int i;
+
+	for (i = 0; i < 27; i++)
+		parity ^= (slots >> i) & 1;
+	slots |= (uint32_t)parity << 27;
+
+	for (i = 0; i < 28; i++) {
+		level = !level;
+		cells = cells << 1 | level;
+		if ((slots >> i) & 1)
+			level = !level;
+		cells = cells << 1 | level;
+	}
+	encoded[0] = cells >> 32;
+	encoded[1] = (uint32_t)cells;
+}
+
+/* encodes nframes frames of src with the per-frame wrappers of the format */
+static void spdif_selftest_encode_frames(struct spdif_encoder *enc,
+					 uint32_t *dst, const uint8_t *src,
+					 unsigned int nframes,
+					 enum spdif_format format)
+{
+	unsigned int i;
+
+	for (i = 0; i < nframes; i++, dst += 4) {
+		switch (format) {
+		case SPDIF_FORMAT_S16_LE:
+			spdif_encode_frame_s16le(enc, dst, src + 4 * i);
+			break;
+		case SPDIF_FORMAT_S24_LE:
+			spdif_encode_frame_s24le(enc, dst, src + 8 * i);
+			break;
+		case SPDIF_FORMAT_S24_3LE:
+			spdif_encode_frame_s24le_packed(enc, dst, src + 6 * i);
+			break;
+		case SPDIF_FORMAT_S32_LE:
+			spdif_encode_frame_s32le(enc, dst, src + 8 * i);
+			break;
+		default:
+			spdif_encode_frame_generic(enc, dst, 0, 0);
+			break;
+		}
+	}
+}
+
+static int spdif_selftest_golden(struct spdif_selftest *t,
+				 const struct spdif_encoder_impl *impl,
+				 const struct spdif_selftest_golden *g)
+{
+	unsigned int frame;
+	bool c;
+	int i;
+
+	memset(t->cs, 0, sizeof(t->cs));
+	for (i = 0; i < 4; i++) {
+		frame = (g->start + i) % SPDIF_BLOCKSIZE;
+		c = (g->c >> i) & 1;
+		t->cs[frame / 8] |= c << (frame % 8);
+		spdif_selftest_bmc(&t->reference[4 * i],
+				   frame ? SPDIF_SELFTEST_PREAMBLE_X :
+				   SPDIF_SELFTEST_PREAMBLE_Z,
+				   g->samples[i][0], c);
+		spdif_selftest_bmc(&t->reference[4 * i + 2],
+				   SPDIF_SELFTEST_PREAMBLE_Y,
+				   g->samples[i][1], c);
+	}
+	memcpy(t->pcm, g->pcm, sizeof(g->pcm));
+
+	spdif_encoder_init(&t->enc);
+	spdif_encoder_set_channel_status(&t->enc, t->cs, SPDIF_CHSTATSIZE);
+	if (g->sample_mask)
+		spdif_encoder_set_sample_mask(&t->enc, g->sample_mask);
+	t->enc.frame_ctr = g->start;
+	if (impl) {
+		spdif_encoder_set_impl(&t->enc, impl);
+		spdif_encode_block(&t->enc, t->encoded, t->pcm, 4, g->format);
+	} else {
+		spdif_selftest_encode_frames(&t->enc, t->encoded, t->pcm, 4,
+					     g->format);
+	}
+	return memcmp(t->encoded, t->reference, 4 * SPDIF_FRAMESIZE) ? -EIO : 0;
+}
+
+/* sample of subframe i of the input, shifted to the sample position */
+static uint32_t spdif_selftest_sample(const struct spdif_selftest *t,
+				      enum spdif_format format, int i)
+{
+	const uint8_t *p = t->pcm;
+
+	switch (format) {
+	case SPDIF_FORMAT_S16_LE:
+		p += 2 * i;
+		return (uint32_t)(p[0] | p[1] << 8) << 12;
+	case SPDIF_FORMAT_S24_LE:
+		p += 4 * i;
+		return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) << 4;
+	case SPDIF_FORMAT_S24_3LE:
+		p += 3 * i;
+		return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16) << 4;
+	case SPDIF_FORMAT_S32_LE:
+		p += 4 * i;
+		return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) >> 4;
+	default:
+		return 0;
+	}
+}
+
+/* checks the output of the implementation through the decoder */
+static int spdif_selftest_decode(struct spdif_selftest *t,
+				 enum spdif_format format,
+				 unsigned int start, uint32_t sample_mask)
+{
+	unsigned int frame, n;
+	uint32_t left, right;
+	bool c;
+
+	spdif_decoder_init(&t->dec);
+	n = spdif_decode_block(&t->dec, t->decoded, t->encoded,
+			       SPDIF_SELFTEST_FRAMES);
+	if (n != SPDIF_SELFTEST_FRAMES)
+		return -EIO;
+
+	for (n = 0; n < SPDIF_SELFTEST_FRAMES; n++) {
+		frame = (start + n) % SPDIF_BLOCKSIZE;
+		left = t->decoded[2 * n];
+		right = t->decoded[2 * n + 1];
+		if ((left & SPDIF_PREAMBLE_MASK) !=
+		    (frame ? SPDIF_PREAMBLE_X : SPDIF_PREAMBLE_Z))
+			return -EIO;
+		c = (t->cs[frame / 8] >> (frame % 8)) & 1;
+		if (!!(left & SPDIF_C_MASK) != c || !!(right & SPDIF_C_MASK) != c)
+			return -EIO;
+		if ((left & (SPDIF_U_MASK | SPDIF_V_MASK)) ||
+		    (right & (SPDIF_U_MASK | SPDIF_V_MASK)))
+			return -EIO;
+		if ((left & SPDIF_SAMPLE_MASK) !=
+		    (spdif_selftest_sample(t, format, 2 * n) & sample_mask) ||
+		    (right & SPDIF_SAMPLE_MASK) !=
+		    (spdif_selftest_sample(t, format, 2 * n + 1) & sample_mask))
+			return -EIO;
+	}
+	if (!t->dec.channel_status_valid ||
+	    memcmp(t->dec.channel_status, t->cs, SPDIF_CHSTATSIZE))
+		return -EIO;
+	return 0;
+}
+
+static int spdif_selftest_random_input(struct spdif_selftest *t,
+				       const struct spdif_encoder_impl *impl)
+{
+	static const enum spdif_format formats[] = {
+		SPDIF_FORMAT_NONE, SPDIF_FORMAT_S16_LE, SPDIF_FORMAT_S24_LE,
+		SPDIF_FORMAT_S24_3LE, SPDIF_FORMAT_S32_LE,
+	};
+	static const size_t frame_size[] = {
+		[SPDIF_FORMAT_S16_LE] = 4, [SPDIF_FORMAT_S24_LE] = 8,
+		[SPDIF_FORMAT_S24_3LE] = 6, [SPDIF_FORMAT_S32_LE] = 8,
+	};
+	/* full, 20-bit, 16-bit (as set up by the driver) or random */
+	static const uint32_t sample_masks[] = {
+		SPDIF_SAMPLE_MASK, 0x0fffff00, 0x0ffff000, 0,
+	};
+	enum spdif_format format;
+	unsigned int start, done, n;
+	uint32_t sample_mask;
+	size_t i;
+
+	format = formats[spdif_selftest_random(t) % 5];
+	sample_mask = sample_masks[spdif_selftest_random(t) % 4];
+	if (!sample_mask)
+		sample_mask = spdif_selftest_random(t);
+	start = spdif_selftest_random(t) % SPDIF_BLOCKSIZE;
+	for (i = 0; i < SPDIF_CHSTATSIZE; i++)
+		t->cs[i] = spdif_selftest_random(t);
+	for (i = 0; i < sizeof(t->pcm); i++)
+		t->pcm[i] = spdif_selftest_random(t);
+
+	spdif_encoder_init(&t->enc);
+	spdif_encoder_set_channel_status(&t->enc, t->cs, SPDIF_CHSTATSIZE);
+	spdif_encoder_set_sample_mask(&t->enc, sample_mask);
+	spdif_encoder_set_impl(&t->enc, impl);
+	t->enc.frame_ctr = start;
+	t->ref = t->enc;
+
+	/* random splits, as left by the DMA periods */
+	for (done = 0; done < SPDIF_SELFTEST_FRAMES; done += n) {
+		n = 1 + spdif_selftest_random(t) % (SPDIF_SELFTEST_FRAMES - done);
+		if (format == SPDIF_FORMAT_NONE)
+			spdif_encode_silence(&t->enc, &t->encoded[4 * done], n);
+		else
+			spdif_encode_block(&t->enc, &t->encoded[4 * done],
+					   t->pcm + done * frame_size[format],
+					   n, format);
+	}
+	spdif_selftest_encode_frames(&t->ref, t->reference, t->pcm,
+				     SPDIF_SELFTEST_FRAMES, format);
+	if (memcmp(t->encoded, t->reference, sizeof(t->encoded)))
+		return -EIO;
+	return spdif_selftest_decode(t, format, start, t->enc.sample_mask);
+}
+
+int spdif_encoder_selftest_golden(const struct spdif_encoder_impl *impl,
+				  enum spdif_selftest_case golden)
+{
+	struct spdif_selftest *t;
+	int ret;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (t == NULL)
+		return -ENOMEM;
+	ret = spdif_selftest_golden(t, impl, &spdif_golden[golden]);
+	kfree(t);
+	return ret;
+}
+
+int spdif_encoder_selftest_random(const struct spdif_encoder_impl *impl,
+				  unsigned int iterations, uint32_t seed)
+{
+	struct spdif_selftest *t;
+	int ret = 0;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (t == NULL)
+		return -ENOMEM;
+	t->state = seed ? seed : 1;
+	while (!ret && iterations--)
+		ret = spdif_selftest_random_input(t, impl);
+	kfree(t);
+	return ret;
+}
+
+int spdif_encoder_selftest(const struct spdif_encoder_impl *impl,
+			   unsigned int iterations, uint32_t seed)
+{
+	struct spdif_selftest *t;
+	int golden, ret = 0;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (t == NULL)
+		return -ENOMEM;
+	t->state = seed ? seed : 1;
+
+	for (golden = 0; !ret && golden < SPDIF_SELFTEST_GOLDEN_CASES; golden++)
+		ret = spdif_selftest_golden(t, impl, &spdif_golden[golden]);
+	while (!ret && iterations--)
+		ret = spdif_selftest_random_input(t, impl);
+
+	kfree(t);
+	return ret;
+}
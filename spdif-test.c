@@ -0,0 +1,62 @@
+/*
+ * SPDIF encoder tests (userspace)
+ *
+ * Runs the encoder self-test of spdif-selftest.c, the one the driver runs
+ * before it uses an encoder, on every encoder implementation with many
+ * rounds of random input, and the golden frames on the per-frame
+ * spdif_encode_frame_* wrappers. The seed is printed so that a failure can
+ * be repeated by passing it on the command line.
+ *
+ * Build and run with "make test".
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "spdif-encoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_SELFTEST_ROUNDS	500	/* random input rounds per encoder */
+
+int main(int argc, char *argv[])
+{
+	const struct spdif_encoder_impl *const *impl;
+	uint32_t seed = time(NULL);
+	int golden, ret = 0, failed = 0;
+
+	if (argc > 1)
+		seed = strtoul(argv[1], NULL, 0);
+	printf("seed %u\n", seed);
+
+	for (golden = 0; !ret && golden < SPDIF_SELFTEST_GOLDEN_CASES; golden++)
+		ret = spdif_encoder_selftest_golden(NULL, golden);
+	printf("%-8s %s", "wrappers", ret ? "FAILED" : "ok");
+	if (ret)
+		printf(": %d", ret);
+	printf("\n");
+	failed |= ret;
+
+	for (impl = spdif_encoder_impls; *impl; impl++) {
+		if ((*impl)->usable && !(*impl)->usable()) {
+			printf("%-8s skipped, not usable on this CPU\n",
+			       (*impl)->name);
+			continue;
+		}
+		ret = spdif_encoder_selftest(*impl, TEST_SELFTEST_ROUNDS, seed);
+		printf("%-8s %s", (*impl)->name, ret ? "FAILED" : "ok");
+		if (ret)
+			printf(": %d", ret);
+		printf("\n");
+		failed |= ret;
+	}
+	return failed ? 1 : 0;
+}